@@ -1,11 +1,43 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <libusb-1.0/libusb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <limits.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MIN(a, b)  (((a) < (b)) ? (a) : (b))
+#define MAX(a, b)  (((a) > (b)) ? (a) : (b))
+
+#define BLOCK_SIZE 4096
+#define MAX_MODULES 64
+#define SCAN_WINDOW 8
+#define MAX_PATTERNS 16
+#define MAX_PATLEN 64
+
+static int verbose;
+
+struct option options[] = {
+	{ "dump", required_argument,      0, 'd' },
+	{ "reference", required_argument, 0, 'c' },
+	{ "rescan", no_argument,          0, 'n' },
+	{ "search", required_argument,    0, 's' },
+	{ "range", required_argument,     0, 'a' },
+	{ "verbose", no_argument,         0, 'v' },
+	{ "help", no_argument,            0, 'h' },
+	{ 0, 0, 0, 0 }
+};
 
 struct module_info {
 	char magic[4]; // MK06
@@ -18,6 +50,33 @@ struct module_info {
 	uint32_t csum;
 } __attribute__((packed));
 
+/* module table cache entry */
+struct cached_module {
+	uint32_t slot;
+	struct module_info info;
+} __attribute__((packed));
+
+/* byte pattern for --search, bits cleared in mask match anything */
+struct pattern {
+	const char *text;
+	uint8_t bytes[MAX_PATLEN];
+	uint8_t mask[MAX_PATLEN];
+	int len;
+	int anchor;
+};
+
+/* state of a search over one address range */
+struct search {
+	uint32_t base;
+	size_t min_end;
+	struct module_info *modules;
+	int nmodules;
+	int hits;
+};
+
+static struct pattern patterns[MAX_PATTERNS];
+static int npatterns, maxpatlen;
+
 static void hexdump_line(char *out, uint8_t *buf, size_t len)
 {
 	for (size_t i = 0; i < 16; i++) {
@@ -48,6 +107,163 @@ void hexdump(char *prefix, void *buf, size_t len)
 	}
 }
 
+/*
+ * Module checksum: 32 bit sum over all bytes in [base, end). The
+ * kernels only differ in how many bytes they fold per step, so a
+ * checksum can be built incrementally from arbitrary sized blocks.
+ */
+static uint32_t csum_scalar(uint32_t sum, const uint8_t *buf, size_t len)
+{
+	while (len--)
+		sum += *buf++;
+	return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint32_t csum_sse2(uint32_t sum, const uint8_t *buf, size_t len)
+{
+	__m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+
+	for (; len >= 16; buf += 16, len -= 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)buf), zero));
+
+	sum += (uint32_t)_mm_cvtsi128_si32(acc) +
+	       (uint32_t)_mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+	return csum_scalar(sum, buf, len);
+}
+
+__attribute__((target("avx2")))
+static uint32_t csum_avx2(uint32_t sum, const uint8_t *buf, size_t len)
+{
+	__m256i acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+	__m128i lo;
+
+	for (; len >= 32; buf += 32, len -= 32)
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)buf), zero));
+
+	lo = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	sum += (uint32_t)_mm_cvtsi128_si32(lo) +
+	       (uint32_t)_mm_cvtsi128_si32(_mm_unpackhi_epi64(lo, lo));
+	return csum_scalar(sum, buf, len);
+}
+#endif
+
+static uint32_t (*csum_update)(uint32_t sum, const uint8_t *buf, size_t len) = csum_scalar;
+
+static void report(struct search *s, uint32_t addr, int pi)
+{
+	const char *module = NULL;
+
+	for (int i = 0; i < s->nmodules; i++)
+		if (addr >= ntohl(s->modules[i].base) && addr < ntohl(s->modules[i].end))
+			module = s->modules[i].name;
+
+	printf("%08x: %s%s%s\n", addr, patterns[pi].text, module ? " in " : "", module ? module : "");
+	s->hits++;
+}
+
+/*
+ * Check a pattern whose anchor byte was seen at pos. Matches ending
+ * before min_end were already reported with the previous block.
+ */
+static void verify(struct search *s, const uint8_t *buf, size_t len, int pi, size_t pos)
+{
+	struct pattern *p = &patterns[pi];
+	size_t start;
+
+	if (pos < (size_t)p->anchor)
+		return;
+	start = pos - p->anchor;
+	if (start + p->len > len || start + p->len <= s->min_end)
+		return;
+
+	for (int i = 0; i < p->len; i++)
+		if ((buf[start + i] ^ p->bytes[i]) & p->mask[i])
+			return;
+	report(s, s->base + start, pi);
+}
+
+/*
+ * Multi pattern search: the vector kernels look for the anchor byte of
+ * every pattern 16 or 32 positions at a time, only the hits are
+ * compared in full.
+ */
+static void search_scalar(struct search *s, const uint8_t *buf, size_t len, size_t from)
+{
+	for (size_t i = from; i < len; i++)
+		for (int pi = 0; pi < npatterns; pi++)
+			if (buf[i] == patterns[pi].bytes[patterns[pi].anchor])
+				verify(s, buf, len, pi, i);
+}
+
+static void search_generic(struct search *s, const uint8_t *buf, size_t len)
+{
+	search_scalar(s, buf, len, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void search_sse2(struct search *s, const uint8_t *buf, size_t len)
+{
+	__m128i anchors[MAX_PATTERNS];
+	size_t i;
+
+	for (int pi = 0; pi < npatterns; pi++)
+		anchors[pi] = _mm_set1_epi8(patterns[pi].bytes[patterns[pi].anchor]);
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+
+		for (int pi = 0; pi < npatterns; pi++) {
+			unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, anchors[pi]));
+
+			for (; m; m &= m - 1)
+				verify(s, buf, len, pi, i + __builtin_ctz(m));
+		}
+	}
+	search_scalar(s, buf, len, i);
+}
+
+__attribute__((target("avx2")))
+static void search_avx2(struct search *s, const uint8_t *buf, size_t len)
+{
+	__m256i anchors[MAX_PATTERNS];
+	size_t i;
+
+	for (int pi = 0; pi < npatterns; pi++)
+		anchors[pi] = _mm256_set1_epi8(patterns[pi].bytes[patterns[pi].anchor]);
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+
+		for (int pi = 0; pi < npatterns; pi++) {
+			unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, anchors[pi]));
+
+			for (; m; m &= m - 1)
+				verify(s, buf, len, pi, i + __builtin_ctz(m));
+		}
+	}
+	search_scalar(s, buf, len, i);
+}
+#endif
+
+static void (*search_block)(struct search *s, const uint8_t *buf, size_t len) = search_generic;
+
+static void cpu_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		csum_update = csum_avx2;
+		search_block = search_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		csum_update = csum_sse2;
+		search_block = search_sse2;
+	}
+#endif
+}
+
 static int restart(libusb_device_handle *dev, int mode)
 {
 	uint8_t restart[] = { 0xa0, 's', 0, 0, 0, mode };
@@ -87,7 +303,7 @@ static int unlock(libusb_device_handle *dev)
 	return 0;
 }
 
-static int getid(libusb_device_handle *dev)
+static int getid(libusb_device_handle *dev, char *id, size_t idlen)
 {
 	uint8_t cmd[] = { "\xa0pID    " };
 	uint8_t response[256];
@@ -109,7 +325,8 @@ static int getid(libusb_device_handle *dev)
 		fprintf(stderr, "%s: received invalid response\n", __func__);
 		return LIBUSB_ERROR_IO;
 	}
-	printf("Keyboard ID: %.*s\n", sent - 8, response + 8);
+	snprintf(id, idlen, "%.*s", sent - 8, response + 8);
+	printf("Keyboard ID: %s\n", id);
 	return 0;
 }
 
@@ -125,13 +342,15 @@ static int readmem(libusb_device_handle *dev, uint32_t base, int len, uint8_t *o
 	struct readcmd cmd = { 0xa0, "pREAD  ", htonl(base), htonl(len) };
 	int ret, sent = 0;
 
-	hexdump("CMD", &cmd, sizeof(cmd));
+	if (verbose)
+		hexdump("CMD", &cmd, sizeof(cmd));
 	ret = libusb_bulk_transfer(dev, 0x06, (uint8_t *)&cmd, sizeof(cmd), &sent, 1000);
 	if (ret < 0) {
 		fprintf(stderr, "%s: failed to send USB request: %s\n", __func__, libusb_strerror(ret));
 		return ret;
 	}
-	fprintf(stderr, "%s: sent %d bytes\n", __func__, sent);
+	if (verbose)
+		fprintf(stderr, "%s: sent %d bytes\n", __func__, sent);
 
 	for (;;) {
 		ret = libusb_bulk_transfer(dev, 0x85, out, MIN(len, 4096), &sent, 10000000);
@@ -145,43 +364,454 @@ static int readmem(libusb_device_handle *dev, uint32_t base, int len, uint8_t *o
 			break;
 	}
 
+	if (len > 0) {
+		fprintf(stderr, "%s: short read, %d bytes missing\n", __func__, len);
+		return LIBUSB_ERROR_IO;
+	}
 	return 0;
 }
 
-static int get_module_info(libusb_device_handle *dev, int id, struct module_info *info)
+static int send_module_query(libusb_device_handle *dev, int id)
 {
 	uint8_t cmd[] = { 0xa0, 'q', 0, 0, 0, id };
-	uint8_t response[260] = { 0 }, *p;
-	int ret, total = 0, sent = 0;
+	int ret, sent = 0;
 
 	ret = libusb_bulk_transfer(dev, 0x06, cmd, sizeof(cmd), &sent, 1000);
 	if (ret < 0) {
 		fprintf(stderr, "%s: failed to send USB request: %s\n", __func__, libusb_strerror(ret));
 		return ret;
 	}
+	return 0;
+}
+
+/*
+ * Receive one 258 byte module table reply. Returns 1 for a module and
+ * 0 for an empty slot.
+ */
+static int recv_module_info(libusb_device_handle *dev, struct module_info *info, unsigned int timeout)
+{
+	uint8_t response[320] = { 0 };
+	int ret, total = 0, sent = 0;
 
-	p = response;
 	for (;;) {
-		ret = libusb_bulk_transfer(dev, 0x85, p, sizeof(response), &sent, 1000);
+		ret = libusb_bulk_transfer(dev, 0x85, response + total, sizeof(response) - total,
+					   &sent, timeout);
 		if (ret < 0) {
 			fprintf(stderr, "%s: failed to receive USB request: %s\n", __func__, libusb_strerror(ret));
 			return ret;
 		}
 		total += sent;
-		p += sent;
-		if (sent < 64)
+		if (sent < 64 || total >= (int)sizeof(response))
 			break;
 	}
 
 	if (total != 258 || response[0] != 0xa0 || response[1] != 0x71) {
 		fprintf(stderr, "%s: received invalid response\n", __func__);
-		printf("\n");
 		return LIBUSB_ERROR_IO;
 	}
 
 	if (strncmp((char *)response + 2, "MK06", 4))
-		return -1;
+		return 0;
 	memcpy(info, response + 2, sizeof(struct module_info));
+	return 1;
+}
+
+/* throw away replies still queued after a failed scan */
+static void drain(libusb_device_handle *dev)
+{
+	uint8_t buf[320];
+	int sent;
+
+	while (libusb_bulk_transfer(dev, 0x85, buf, sizeof(buf), &sent, 200) == 0)
+		;
+}
+
+static long elapsed_ms(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Keep up to window queries in flight. The bootloader answers in
+ * order, so the n-th reply belongs to the n-th query. The first reply
+ * sets the receive timeout for the rest of the scan. A slot without a
+ * valid reply is asked again on its own and counted as empty if that
+ * fails too; the queries behind it are drained and sent again.
+ */
+static int scan_window(libusb_device_handle *dev, struct module_info *modules, int *slots,
+		       int max, int window)
+{
+	unsigned int timeout = 1000;
+	struct module_info info;
+	struct timespec start;
+	int queued = 0, received = 0, count = 0, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (received < max) {
+		while (queued < max && queued - received < window) {
+			if (send_module_query(dev, queued) < 0)
+				return -1;
+			queued++;
+		}
+
+		ret = recv_module_info(dev, &info, timeout);
+		if (ret < 0 && window > 1) {
+			drain(dev);
+			queued = received;
+			if (send_module_query(dev, queued++) < 0)
+				return -1;
+			ret = recv_module_info(dev, &info, 1000);
+			/* answered alone but not queued, stop queueing */
+			if (ret >= 0)
+				window = 1;
+		}
+		if (ret < 0) {
+			fprintf(stderr, "%s: slot %d: no valid reply, counted as empty\n",
+				__func__, received);
+			drain(dev);
+			ret = 0;
+		}
+
+		if (!received && window > 1)
+			timeout = MIN(1000, MAX(50, 4 * elapsed_ms(&start)));
+
+		if (ret == 1) {
+			slots[count] = received;
+			modules[count++] = info;
+		}
+		received++;
+	}
+	return count;
+}
+
+/*
+ * Empty and erased slots may sit between modules, so all max slots are
+ * queried. Fall back to one query at a time if queued requests can't
+ * be sent.
+ */
+static int scan_modules(libusb_device_handle *dev, struct module_info *modules, int *slots, int max)
+{
+	int count = scan_window(dev, modules, slots, max, SCAN_WINDOW);
+
+	if (count >= 0)
+		return count;
+
+	fprintf(stderr, "%s: retrying without queued requests\n", __func__);
+	drain(dev);
+	return scan_window(dev, modules, slots, max, 1);
+}
+
+/*
+ * A reflash changes the module table but not the pID, so the cached
+ * entries are queried again before anything is read by them.
+ */
+static int verify_modules(libusb_device_handle *dev, struct module_info *modules, int *slots,
+			  int count)
+{
+	struct module_info info;
+
+	for (int i = 0; i < count; i++) {
+		if (send_module_query(dev, slots[i]) < 0 ||
+		    recv_module_info(dev, &info, 1000) != 1 ||
+		    memcmp(&info, &modules[i], sizeof(info))) {
+			drain(dev);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int cache_path(char *out, size_t len, const char *id)
+{
+	char *base = getenv("XDG_CACHE_HOME"), dir[PATH_MAX / 2];
+	char name[64];
+	size_t i;
+
+	if (base && *base) {
+		snprintf(dir, sizeof(dir), "%s/weytools", base);
+	} else {
+		base = getenv("HOME");
+		if (!base)
+			return -1;
+		snprintf(dir, sizeof(dir), "%s/.cache", base);
+		mkdir(dir, 0755);
+		snprintf(dir, sizeof(dir), "%s/.cache/weytools", base);
+	}
+	mkdir(dir, 0755);
+
+	for (i = 0; id[i] && i < sizeof(name) - 1; i++)
+		name[i] = isalnum((unsigned char)id[i]) || id[i] == '-' ? id[i] : '_';
+	name[i] = '\0';
+
+	snprintf(out, len, "%s/modules-%s", dir, name);
+	return 0;
+}
+
+static int load_modules(const char *id, struct module_info *modules, int *slots, int max)
+{
+	struct cached_module entry;
+	char path[PATH_MAX];
+	int fd, count = 0;
+	ssize_t len;
+
+	if (cache_path(path, sizeof(path), id) < 0)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	while ((len = read(fd, &entry, sizeof(entry))) == sizeof(entry)) {
+		if (count == max || strncmp(entry.info.magic, "MK06", 4) || entry.slot >= MAX_MODULES) {
+			close(fd);
+			return -1;
+		}
+		slots[count] = entry.slot;
+		modules[count++] = entry.info;
+	}
+	close(fd);
+	if (!count || len)
+		return -1;
+	return count;
+}
+
+static void save_modules(const char *id, struct module_info *modules, int *slots, int count)
+{
+	struct cached_module entry;
+	char path[PATH_MAX];
+	int fd;
+
+	if (cache_path(path, sizeof(path), id) < 0)
+		return;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1)
+		return;
+	for (int i = 0; i < count; i++) {
+		entry.slot = slots[i];
+		entry.info = modules[i];
+		if (write(fd, &entry, sizeof(entry)) != sizeof(entry)) {
+			unlink(path);
+			break;
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Stream one module into outfd at its flash address and verify the
+ * module checksum on the way. With a reference image only blocks that
+ * differ from the reference are written out.
+ */
+static int dump_module(libusb_device_handle *dev, struct module_info *info, int outfd,
+		       const uint8_t *ref, size_t reflen)
+{
+	uint32_t base = ntohl(info->base), end = ntohl(info->end), sum = 0;
+	uint8_t buf[BLOCK_SIZE];
+	uint32_t len;
+
+	for (uint32_t addr = base; addr < end; addr += len) {
+		len = MIN(end - addr, BLOCK_SIZE);
+		if (readmem(dev, addr, len, buf) < 0)
+			return -1;
+		sum = csum_update(sum, buf, len);
+
+		if (ref) {
+			if (addr + len <= reflen && !memcmp(buf, ref + addr, len))
+				continue;
+			printf("    %08x - %08x differs\n", addr, addr + len);
+		}
+
+		if (pwrite(outfd, buf, len, addr) != (ssize_t)len) {
+			fprintf(stderr, "%s: write: %m\n", __func__);
+			return -1;
+		}
+	}
+
+	if (sum != ntohl(info->csum)) {
+		fprintf(stderr, "%s: %s: checksum mismatch, expected %08x, got %08x\n",
+			__func__, info->name, ntohl(info->csum), sum);
+		return -1;
+	}
+	return 0;
+}
+
+static int dump_modules(libusb_device_handle *dev, struct module_info *modules, int count,
+			char *outname, char *refname)
+{
+	uint8_t *ref = NULL;
+	size_t reflen = 0;
+	struct stat statbuf;
+	int outfd, reffd, ret = 0;
+
+	if (refname) {
+		reffd = open(refname, O_RDONLY);
+		if (reffd == -1) {
+			fprintf(stderr, "open %s: %m\n", refname);
+			return -1;
+		}
+
+		if (fstat(reffd, &statbuf) == -1 || !statbuf.st_size) {
+			fprintf(stderr, "%s: empty or unreadable reference image\n", refname);
+			close(reffd);
+			return -1;
+		}
+
+		reflen = statbuf.st_size;
+		ref = mmap(NULL, reflen, PROT_READ, MAP_PRIVATE, reffd, 0);
+		close(reffd);
+		if (ref == MAP_FAILED) {
+			fprintf(stderr, "mmap %s: %m\n", refname);
+			return -1;
+		}
+	}
+
+	outfd = open(outname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (outfd == -1) {
+		fprintf(stderr, "open %s: %m\n", outname);
+		ret = -1;
+		goto out_unmap;
+	}
+
+	for (int i = 0; i < count; i++) {
+		uint32_t base = ntohl(modules[i].base), end = ntohl(modules[i].end);
+
+		if (end <= base)
+			continue;
+
+		if (ref && end <= reflen &&
+		    csum_update(0, ref + base, end - base) == ntohl(modules[i].csum)) {
+			printf("%s: matches reference\n", modules[i].name);
+			continue;
+		}
+
+		printf("%s: %08x - %08x\n", modules[i].name, base, end);
+		if (dump_module(dev, &modules[i], outfd, ref, reflen) < 0)
+			ret = -1;
+	}
+	close(outfd);
+out_unmap:
+	if (ref)
+		munmap(ref, reflen);
+	return ret;
+}
+
+/*
+ * Hex bytes with ?? for any byte, spaces and colons are ignored, e.g.
+ * "4d 4b 30 36" or "a0??0000". A str: prefix takes the rest literally.
+ */
+static int parse_pattern(const char *arg, struct pattern *p)
+{
+	const char *in = arg;
+	unsigned int byte;
+
+	memset(p, 0, sizeof(*p));
+	p->text = arg;
+
+	if (!strncmp(in, "str:", 4)) {
+		for (in += 4; *in; in++) {
+			if (p->len == MAX_PATLEN)
+				goto toolong;
+			p->bytes[p->len] = *in;
+			p->mask[p->len++] = 0xff;
+		}
+	} else {
+		while (*in) {
+			if (*in == ' ' || *in == ':') {
+				in++;
+				continue;
+			}
+			if (p->len == MAX_PATLEN)
+				goto toolong;
+			if (in[0] == '?' && in[1] == '?') {
+				p->mask[p->len++] = 0;
+			} else if (isxdigit((unsigned char)in[0]) && isxdigit((unsigned char)in[1]) &&
+				   sscanf(in, "%2x", &byte) == 1) {
+				p->bytes[p->len] = byte;
+				p->mask[p->len++] = 0xff;
+			} else {
+				fprintf(stderr, "invalid pattern: %s\n", arg);
+				return -1;
+			}
+			in += 2;
+		}
+	}
+
+	/* anchor on a fixed byte, preferably not one erased or blank flash is full of */
+	p->anchor = -1;
+	for (int i = 0; i < p->len; i++) {
+		if (p->mask[i] != 0xff)
+			continue;
+		if (p->bytes[i] != 0x00 && p->bytes[i] != 0xff) {
+			p->anchor = i;
+			break;
+		}
+		if (p->anchor == -1)
+			p->anchor = i;
+	}
+	if (p->anchor == -1) {
+		fprintf(stderr, "pattern needs at least one fixed byte: %s\n", arg);
+		return -1;
+	}
+	return 0;
+toolong:
+	fprintf(stderr, "pattern longer than %d bytes: %s\n", MAX_PATLEN, arg);
+	return -1;
+}
+
+/*
+ * Stream [base, end) through the search. The last bytes of every block
+ * are carried over, so matches across block boundaries are found too.
+ */
+static int search_range(libusb_device_handle *dev, struct search *s, uint32_t base, uint32_t end)
+{
+	uint8_t buf[MAX_PATLEN - 1 + BLOCK_SIZE];
+	size_t carry = 0, keep;
+	uint32_t len;
+
+	for (uint32_t addr = base; addr < end; addr += len) {
+		len = MIN(end - addr, BLOCK_SIZE);
+		if (readmem(dev, addr, len, buf + carry) < 0)
+			return -1;
+
+		s->base = addr - carry;
+		s->min_end = carry;
+		search_block(s, buf, carry + len);
+
+		keep = MIN(carry + len, (size_t)maxpatlen - 1);
+		memmove(buf, buf + carry + len - keep, keep);
+		carry = keep;
+	}
+	return 0;
+}
+
+static int search_modules(libusb_device_handle *dev, struct module_info *modules, int count,
+			  char *range)
+{
+	struct search s = { .modules = modules, .nmodules = count };
+	unsigned int base, len;
+
+	if (range) {
+		if (sscanf(range, "%x:%x", &base, &len) != 2 || !len || base + len < base) {
+			fprintf(stderr, "invalid range: %s\n", range);
+			return -1;
+		}
+		if (search_range(dev, &s, base, base + len) < 0)
+			return -1;
+	} else {
+		for (int i = 0; i < count; i++) {
+			if (ntohl(modules[i].end) <= ntohl(modules[i].base))
+				continue;
+			if (search_range(dev, &s, ntohl(modules[i].base), ntohl(modules[i].end)) < 0)
+				return -1;
+		}
+	}
+
+	/* only a complete search has a match count */
+	printf("%d matches\n", s.hits);
 	return 0;
 }
 
@@ -209,12 +839,66 @@ int main(int argc, char **argv)
 	uint8_t dynblcmd[] = { 0x7f, 0xee, 'g', 'o', '-', 'D', 'y', 'n', 'B','l' };
 	struct libusb_context *ctx;
 	libusb_device_handle *dev;
-	struct module_info info;
+	struct module_info modules[MAX_MODULES];
+	int slots[MAX_MODULES];
+	char *dump = NULL, *reference = NULL, *range = NULL, id[256];
 	uint8_t buf2[4096] = { 0 };
-	int sent = 0;
+	int sent = 0, nmodules = -1, rescan = 0, status = 1, optidx, opt;
+
+	while ((opt = getopt_long(argc, argv, "hvnd:c:s:a:", options, &optidx)) != -1) {
+		switch (opt) {
+		case 'd':
+			dump = optarg;
+			break;
+		case 'c':
+			reference = optarg;
+			break;
+		case 'n':
+			rescan = 1;
+			break;
+		case 's':
+			if (npatterns == MAX_PATTERNS) {
+				fprintf(stderr, "too many patterns, max %d\n", MAX_PATTERNS);
+				return 1;
+			}
+			if (parse_pattern(optarg, &patterns[npatterns]) < 0)
+				return 1;
+			maxpatlen = MAX(maxpatlen, patterns[npatterns].len);
+			npatterns++;
+			break;
+		case 'a':
+			range = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+			fprintf(stderr, "%s: usage:%s <options>\n"
+				"-d, --dump <file>       dump all modules into image file\n"
+				"-c, --reference <file>  only dump regions differing from reference image\n"
+				"-n, --rescan            ignore cached module table\n"
+				"-s, --search <pattern>  find hex pattern (?? for any byte) or str:text,\n"
+				"                        may be given several times\n"
+				"-a, --range <base:len>  search this range instead of all modules (hex)\n"
+				"-v, --verbose           log data transfers\n",
+				argv[0], argv[0]);
+			return 0;
+		default:
+			break;
+		}
+	}
 
-	(void)argc;
-	(void)argv;
+	if (reference && !dump) {
+		fprintf(stderr, "--reference requires --dump\n");
+		return 1;
+	}
+
+	if (range && !npatterns) {
+		fprintf(stderr, "--range requires --search\n");
+		return 1;
+	}
+
+	cpu_init();
 
 	int ret = libusb_init(&ctx);
 	if (ret < 0) {
@@ -236,23 +920,43 @@ int main(int argc, char **argv)
 	if (!dev)
 		goto out_exit;
 
-	for (int i = 0; i < 64; i++) {
-		if (get_module_info(dev, i, &info) < 0)
-			continue;
-		printf("%2d: %08x - %08x %s\n", i, ntohl(info.base), ntohl(info.end), info.name);
-	}
-
 	if (unlock(dev) < 0)
-		goto out_release;
+		goto out_restart;
 
-	if (getid(dev) < 0)
-		goto out_release;
-	readmem(dev, 0, 256, buf2);
-	hexdump("BUF", buf2, sizeof(buf2));
+	if (getid(dev, id, sizeof(id)) < 0)
+		goto out_restart;
+
+	if (!rescan)
+		nmodules = load_modules(id, modules, slots, MAX_MODULES);
+	if (nmodules >= 0 && (dump || npatterns) &&
+	    verify_modules(dev, modules, slots, nmodules) < 0) {
+		fprintf(stderr, "cached module table is stale, rescanning\n");
+		nmodules = -1;
+	}
+	if (nmodules < 0) {
+		nmodules = scan_modules(dev, modules, slots, MAX_MODULES);
+		if (nmodules < 0)
+			goto out_restart;
+		save_modules(id, modules, slots, nmodules);
+	}
+
+	for (int i = 0; i < nmodules; i++)
+		printf("%2d: %08x - %08x %08x %s\n", slots[i], ntohl(modules[i].base),
+		       ntohl(modules[i].end), ntohl(modules[i].csum), modules[i].name);
+
+	status = 0;
+	if (dump && dump_modules(dev, modules, nmodules, dump, reference) < 0)
+		status = 1;
+	if (npatterns && search_modules(dev, modules, nmodules, range) < 0)
+		status = 1;
+	if (!dump && !npatterns) {
+		readmem(dev, 0, 256, buf2);
+		hexdump("BUF", buf2, sizeof(buf2));
+	}
+out_restart:
 	restart(dev, 5);
-out_release:
 	libusb_release_interface(dev, 0);
 out_exit:
 	libusb_exit(ctx);
-	return 0;
+	return status;
 }
@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MIN(a, b)  (((a) < (b)) ? (a) : (b))
+
+#define MAX_FILES 256
+/* differing bytes closer than this are reported as one region */
+#define REGION_GAP 16
+#define MAX_REGIONS 16
+
+struct option options[] = {
+	{ "jobs", required_argument, 0, 'j' },
+	{ "regions", no_argument,    0, 'r' },
+	{ "help", no_argument,       0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+typedef enum {
+	FILE_LAYER,
+	FILE_KCT,
+	FILE_MACROS,
+	FILE_USERMENU,
+} filetype_t;
+
+struct region {
+	uint32_t start;
+	uint32_t end;
+};
+
+/* a backed up file, mapped read only while its keyboard is analyzed */
+struct file {
+	char name[64];
+	filetype_t type;
+	int layer;
+	const uint8_t *data;
+	size_t size;
+};
+
+/* per file result of the comparison against the golden set */
+struct diff {
+	const struct file *file;
+	const struct file *golden;
+	int nregions;
+	uint32_t changed;
+	struct region regions[MAX_REGIONS];
+};
+
+struct keyboard {
+	char name[256];
+	struct file files[MAX_FILES];
+	int nfiles;
+	struct diff *diffs;
+	int ndiffs;
+	int nmissing;
+	int failed;
+};
+
+static const char *type_names[] = {
+	[FILE_LAYER] = "layer",
+	[FILE_KCT] = "kct",
+	[FILE_MACROS] = "macros",
+	[FILE_USERMENU] = "usermenu",
+};
+
+static struct keyboard golden;
+static struct keyboard *keyboards;
+static int nkeyboards, nextkeyboard, maxkeyboards;
+static const char *backupdir;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int classify(const char *name, struct file *file)
+{
+	size_t len = strlen(name);
+
+	file->layer = -1;
+	if (sscanf(name, "LAYER%02d.LAY", &file->layer) == 1 && len == 11)
+		file->type = FILE_LAYER;
+	else if (len > 4 && !strcasecmp(name + len - 4, ".kct"))
+		file->type = FILE_KCT;
+	else if (!strcmp(name, "Macros.mac"))
+		file->type = FILE_MACROS;
+	else if (!strcmp(name, "UserMenu.usc"))
+		file->type = FILE_USERMENU;
+	else
+		return -1;
+	return 0;
+}
+
+static int load_keyboard(const char *path, struct keyboard *kbd)
+{
+	char name[PATH_MAX];
+	struct stat statbuf;
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "opendir %s: %m\n", path);
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		struct file *file = &kbd->files[kbd->nfiles];
+		void *data;
+		int fd;
+
+		if (strlen(de->d_name) >= sizeof(file->name) || classify(de->d_name, file) == -1)
+			continue;
+
+		if (kbd->nfiles == MAX_FILES) {
+			fprintf(stderr, "%s: more than %d files\n", path, MAX_FILES);
+			break;
+		}
+
+		/* a file that can't be read must not show up as missing */
+		snprintf(name, sizeof(name), "%s/%s", path, de->d_name);
+		fd = open(name, O_RDONLY);
+		if (fd == -1) {
+			fprintf(stderr, "open %s: %m\n", name);
+			goto fail;
+		}
+
+		if (fstat(fd, &statbuf) == -1) {
+			fprintf(stderr, "fstat %s: %m\n", name);
+			close(fd);
+			goto fail;
+		}
+
+		data = NULL;
+		if (statbuf.st_size) {
+			data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) {
+				fprintf(stderr, "mmap %s: %m\n", name);
+				close(fd);
+				goto fail;
+			}
+		}
+		close(fd);
+
+		strcpy(file->name, de->d_name);
+		file->data = data;
+		file->size = statbuf.st_size;
+		kbd->nfiles++;
+	}
+	closedir(dir);
+	return 0;
+fail:
+	closedir(dir);
+	return -1;
+}
+
+/* names and diffs stay for the report, only the contents go */
+static void unmap_keyboard(struct keyboard *kbd)
+{
+	for (int i = 0; i < kbd->nfiles; i++) {
+		if (kbd->files[i].data)
+			munmap((void *)kbd->files[i].data, kbd->files[i].size);
+		kbd->files[i].data = NULL;
+	}
+}
+
+static void unload_keyboard(struct keyboard *kbd)
+{
+	free(kbd->diffs);
+	kbd->diffs = NULL;
+	unmap_keyboard(kbd);
+	kbd->nfiles = 0;
+}
+
+static const struct file *find_file(const struct keyboard *kbd, const char *name)
+{
+	for (int i = 0; i < kbd->nfiles; i++)
+		if (!strcmp(kbd->files[i].name, name))
+			return &kbd->files[i];
+	return NULL;
+}
+
+/*
+ * Collect differing byte ranges. Whole machine words are compared first,
+ * so identical stretches cost next to nothing.
+ */
+static void compare(struct diff *diff)
+{
+	const uint8_t *a = diff->file->data, *b = diff->golden->data;
+	size_t len = MIN(diff->file->size, diff->golden->size), i = 0;
+	struct region *r = NULL;
+
+	while (i < len) {
+		uint64_t x, y;
+
+		if (i + 8 <= len) {
+			memcpy(&x, a + i, 8);
+			memcpy(&y, b + i, 8);
+			if (x == y) {
+				i += 8;
+				continue;
+			}
+		}
+
+		if (a[i] != b[i]) {
+			diff->changed++;
+			if (r && i - r->end < REGION_GAP) {
+				r->end = i + 1;
+			} else if (diff->nregions < MAX_REGIONS) {
+				r = &diff->regions[diff->nregions++];
+				r->start = i;
+				r->end = i + 1;
+			} else {
+				/* out of slots, grow the last region */
+				r->end = i + 1;
+			}
+		}
+		i++;
+	}
+
+	/* size changes count as a changed tail */
+	if (diff->file->size != diff->golden->size) {
+		size_t end = diff->file->size > diff->golden->size ? diff->file->size : diff->golden->size;
+
+		diff->changed += end - len;
+		if (r && len - r->end < REGION_GAP)
+			r->end = end;
+		else if (diff->nregions < MAX_REGIONS)
+			diff->regions[diff->nregions++] = (struct region){ len, end };
+		else
+			r->end = end;
+	}
+}
+
+static int analyze(struct keyboard *kbd)
+{
+	kbd->diffs = malloc(kbd->nfiles * sizeof(*kbd->diffs));
+	if (!kbd->diffs && kbd->nfiles) {
+		fprintf(stderr, "%s: out of memory\n", kbd->name);
+		return -1;
+	}
+
+	for (int i = 0; i < kbd->nfiles; i++) {
+		struct diff *diff = &kbd->diffs[kbd->ndiffs];
+
+		memset(diff, 0, sizeof(*diff));
+		diff->file = &kbd->files[i];
+		diff->golden = find_file(&golden, kbd->files[i].name);
+		if (diff->golden)
+			compare(diff);
+		if (!diff->golden || diff->changed)
+			kbd->ndiffs++;
+	}
+
+	for (int i = 0; i < golden.nfiles; i++)
+		if (!find_file(kbd, golden.files[i].name))
+			kbd->nmissing++;
+	return 0;
+}
+
+/*
+ * Keyboards are mapped one at a time per thread and unmapped right
+ * after the comparison, so a large fleet doesn't run into the limit
+ * on mappings.
+ */
+static void *worker(void *arg)
+{
+	char path[PATH_MAX];
+
+	(void)arg;
+
+	for (;;) {
+		struct keyboard *kbd;
+		int i;
+
+		pthread_mutex_lock(&lock);
+		i = nextkeyboard++;
+		pthread_mutex_unlock(&lock);
+		if (i >= nkeyboards)
+			break;
+
+		kbd = &keyboards[i];
+		snprintf(path, sizeof(path), "%s/%s", backupdir, kbd->name);
+		if (load_keyboard(path, kbd) == -1 || analyze(kbd) == -1)
+			kbd->failed = 1;
+		unmap_keyboard(kbd);
+	}
+	return NULL;
+}
+
+static int cmp_keyboard(const void *a, const void *b)
+{
+	return strcmp(((const struct keyboard *)a)->name, ((const struct keyboard *)b)->name);
+}
+
+static void report(struct keyboard *kbd, int regions)
+{
+	if (!kbd->ndiffs && !kbd->nmissing)
+		return;
+
+	printf("%s:\n", kbd->name);
+	for (int i = 0; i < kbd->ndiffs; i++) {
+		struct diff *diff = &kbd->diffs[i];
+
+		if (!diff->golden) {
+			printf("  + %-20s %-8s not in golden set\n", diff->file->name,
+			       type_names[diff->file->type]);
+			continue;
+		}
+
+		printf("  ~ %-20s %-8s %u bytes in %d regions", diff->file->name,
+		       type_names[diff->file->type], diff->changed, diff->nregions);
+		if (diff->file->type == FILE_LAYER)
+			printf(", layer %d", diff->file->layer);
+		printf("\n");
+
+		for (int r = 0; regions && r < diff->nregions; r++)
+			printf("      %06x - %06x\n", diff->regions[r].start, diff->regions[r].end);
+	}
+
+	for (int i = 0; kbd->nmissing && i < golden.nfiles; i++)
+		if (!find_file(kbd, golden.files[i].name))
+			printf("  - %-20s %-8s missing\n", golden.files[i].name,
+			       type_names[golden.files[i].type]);
+}
+
+int main(int argc, char **argv)
+{
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN), optidx, opt, regions = 0, drifted = 0, failed = 0;
+	pthread_t threads[256];
+	struct dirent *de;
+	char *endp;
+	DIR *dir;
+
+	while ((opt = getopt_long(argc, argv, "hrj:", options, &optidx)) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = strtoul(optarg, &endp, 10);
+			if (*endp || !jobs) {
+				fprintf(stderr, "invalid number of jobs: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			regions = 1;
+			break;
+		case 'h':
+			fprintf(stderr, "%s: usage:%s <options> <golden dir> <backup dir>\n"
+				"-j, --jobs <n>          number of analysis threads\n"
+				"-r, --regions           list changed byte ranges\n",
+				argv[0], argv[0]);
+			return 0;
+		default:
+			break;
+		}
+	}
+
+	if (argc - optind != 2) {
+		fprintf(stderr, "%s: need golden and backup directory\n", argv[0]);
+		return 1;
+	}
+
+	if (load_keyboard(argv[optind], &golden) == -1)
+		return 1;
+
+	/* one directory per keyboard, loaded by the workers */
+	backupdir = argv[optind + 1];
+	dir = opendir(backupdir);
+	if (!dir) {
+		fprintf(stderr, "opendir %s: %m\n", backupdir);
+		return 1;
+	}
+
+	while ((de = readdir(dir))) {
+		struct keyboard *kbd;
+
+		if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(kbd->name))
+			continue;
+
+		if (nkeyboards == maxkeyboards) {
+			maxkeyboards = maxkeyboards ? maxkeyboards * 2 : 64;
+			kbd = realloc(keyboards, maxkeyboards * sizeof(*keyboards));
+			if (!kbd) {
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+			keyboards = kbd;
+		}
+
+		kbd = &keyboards[nkeyboards++];
+		memset(kbd, 0, sizeof(*kbd));
+		strcpy(kbd->name, de->d_name);
+	}
+	closedir(dir);
+	qsort(keyboards, nkeyboards, sizeof(*keyboards), cmp_keyboard);
+
+	jobs = MIN(MIN(jobs, nkeyboards), (int)(sizeof(threads) / sizeof(threads[0])));
+	for (int i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL)) {
+			fprintf(stderr, "pthread_create failed\n");
+			jobs = i;
+			break;
+		}
+	}
+	worker(NULL);
+	for (int i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+
+	for (int i = 0; i < nkeyboards; i++) {
+		if (keyboards[i].failed) {
+			printf("%s: not analyzed\n", keyboards[i].name);
+			failed++;
+		} else {
+			report(&keyboards[i], regions);
+			if (keyboards[i].ndiffs || keyboards[i].nmissing)
+				drifted++;
+		}
+		unload_keyboard(&keyboards[i]);
+	}
+	unload_keyboard(&golden);
+	free(keyboards);
+
+	printf("%d keyboards, %d differ from golden set", nkeyboards, drifted);
+	if (failed)
+		printf(", %d not analyzed", failed);
+	printf("\n");
+	return failed ? 1 : drifted ? 2 : 0;
+}
@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <png.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define MIN(a, b)  (((a) < (b)) ? (a) : (b))
+
+/* keyboard icons: 80 x 70, 8 bit palettized, bits offset 1078 */
+#define ICON_WIDTH 80
+#define ICON_HEIGHT 70
+#define ICON_STRIDE ((ICON_WIDTH + 3) & ~3)
+#define BMP_HDRSIZE 54
+#define BMP_BITSOFFSET (BMP_HDRSIZE + 256 * 4)
+#define BMP_FILESIZE (BMP_BITSOFFSET + ICON_STRIDE * ICON_HEIGHT)
+
+#define MAX_ICONS 4096
+#define CACHE_NAME ".weyicon.cache"
+/* bump when the output for identical input changes */
+#define CACHE_VERSION 1
+
+struct option options[] = {
+	{ "jobs", required_argument,       0, 'j' },
+	{ "palette", required_argument,    0, 'p' },
+	{ "background", required_argument, 0, 'b' },
+	{ "force", no_argument,            0, 'f' },
+	{ "help", no_argument,             0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+struct icon {
+	char name[256];
+	uint64_t hash;
+	uint64_t cached;
+	int status;
+};
+
+static struct {
+	uint8_t rgb[256][3];
+	/* structure of arrays for the vector kernels */
+	int32_t r[256], g[256], b[256];
+} palette;
+
+static struct icon icons[MAX_ICONS];
+static int nicons, nexticon, force;
+static char *srcdir, *outdir;
+static png_color background;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t fnv1a(uint64_t hash, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Nearest palette entry by squared RGB distance. Distance and index are
+ * packed as (dist << 8 | index), so a plain minimum yields the closest
+ * and, on ties, the lowest entry.
+ */
+static uint8_t nearest_scalar(int r, int g, int b)
+{
+	uint32_t best = UINT32_MAX;
+
+	for (int i = 0; i < 256; i++) {
+		int dr = r - palette.r[i], dg = g - palette.g[i], db = b - palette.b[i];
+		uint32_t d = (uint32_t)(dr * dr + dg * dg + db * db) << 8 | i;
+
+		if (d < best)
+			best = d;
+	}
+	return best & 0xff;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint8_t nearest_sse2(int r, int g, int b)
+{
+	__m128i vr = _mm_set1_epi32(r), vg = _mm_set1_epi32(g), vb = _mm_set1_epi32(b);
+	__m128i best = _mm_set1_epi32(INT32_MAX), idx = _mm_setr_epi32(0, 1, 2, 3);
+	__m128i four = _mm_set1_epi32(4), low = _mm_set1_epi32(0xffff);
+	uint32_t lanes[4], min = UINT32_MAX;
+
+	for (int i = 0; i < 256; i += 4) {
+		__m128i dr = _mm_sub_epi32(vr, _mm_loadu_si128((const __m128i *)&palette.r[i]));
+		__m128i dg = _mm_sub_epi32(vg, _mm_loadu_si128((const __m128i *)&palette.g[i]));
+		__m128i db = _mm_sub_epi32(vb, _mm_loadu_si128((const __m128i *)&palette.b[i]));
+		__m128i d, lt;
+
+		/*
+		 * Differences fit in 16 bit. With the sign extension masked off,
+		 * madd against itself squares them.
+		 */
+		dr = _mm_and_si128(dr, low);
+		dg = _mm_and_si128(dg, low);
+		db = _mm_and_si128(db, low);
+		dr = _mm_madd_epi16(dr, dr);
+		dg = _mm_madd_epi16(dg, dg);
+		db = _mm_madd_epi16(db, db);
+		d = _mm_or_si128(_mm_slli_epi32(_mm_add_epi32(_mm_add_epi32(dr, dg), db), 8), idx);
+
+		lt = _mm_cmplt_epi32(d, best);
+		best = _mm_or_si128(_mm_and_si128(lt, d), _mm_andnot_si128(lt, best));
+		idx = _mm_add_epi32(idx, four);
+	}
+
+	_mm_storeu_si128((__m128i *)lanes, best);
+	for (int i = 0; i < 4; i++)
+		min = MIN(min, lanes[i]);
+	return min & 0xff;
+}
+
+__attribute__((target("avx2")))
+static uint8_t nearest_avx2(int r, int g, int b)
+{
+	__m256i vr = _mm256_set1_epi32(r), vg = _mm256_set1_epi32(g), vb = _mm256_set1_epi32(b);
+	__m256i best = _mm256_set1_epi32(INT32_MAX), idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i eight = _mm256_set1_epi32(8), low = _mm256_set1_epi32(0xffff);
+	__m128i lo;
+	uint32_t lanes[4], min = UINT32_MAX;
+
+	for (int i = 0; i < 256; i += 8) {
+		__m256i dr = _mm256_sub_epi32(vr, _mm256_loadu_si256((const __m256i *)&palette.r[i]));
+		__m256i dg = _mm256_sub_epi32(vg, _mm256_loadu_si256((const __m256i *)&palette.g[i]));
+		__m256i db = _mm256_sub_epi32(vb, _mm256_loadu_si256((const __m256i *)&palette.b[i]));
+		__m256i d;
+
+		dr = _mm256_and_si256(dr, low);
+		dg = _mm256_and_si256(dg, low);
+		db = _mm256_and_si256(db, low);
+		dr = _mm256_madd_epi16(dr, dr);
+		dg = _mm256_madd_epi16(dg, dg);
+		db = _mm256_madd_epi16(db, db);
+		d = _mm256_or_si256(_mm256_slli_epi32(_mm256_add_epi32(_mm256_add_epi32(dr, dg), db), 8), idx);
+		best = _mm256_min_epu32(best, d);
+		idx = _mm256_add_epi32(idx, eight);
+	}
+
+	lo = _mm_min_epu32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+	_mm_storeu_si128((__m128i *)lanes, lo);
+	for (int i = 0; i < 4; i++)
+		min = MIN(min, lanes[i]);
+	return min & 0xff;
+}
+#endif
+
+static uint8_t (*nearest)(int r, int g, int b) = nearest_scalar;
+
+static void nearest_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		nearest = nearest_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		nearest = nearest_sse2;
+#endif
+}
+
+/* 6x6x6 colour cube followed by a grey ramp */
+static void default_palette(void)
+{
+	int n = 0;
+
+	for (int r = 0; r < 6; r++)
+		for (int g = 0; g < 6; g++)
+			for (int b = 0; b < 6; b++, n++) {
+				palette.rgb[n][0] = r * 51;
+				palette.rgb[n][1] = g * 51;
+				palette.rgb[n][2] = b * 51;
+			}
+
+	for (int i = 0; n < 256; i++, n++)
+		palette.rgb[n][0] = palette.rgb[n][1] = palette.rgb[n][2] = (i + 1) * 255 / 41;
+}
+
+/* take the palette from an icon downloaded from the keyboard */
+static int load_palette(char *name)
+{
+	uint8_t hdr[BMP_BITSOFFSET];
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "open %s: %m\n", name);
+		return -1;
+	}
+
+	if (read(fd, hdr, sizeof(hdr)) != sizeof(hdr) || hdr[0] != 'B' || hdr[1] != 'M' ||
+	    hdr[28] != 8) {
+		fprintf(stderr, "%s: not an 8 bit BMP\n", name);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	/* BMP palette entries are stored as B, G, R, 0 */
+	for (int i = 0; i < 256; i++) {
+		palette.rgb[i][0] = hdr[BMP_HDRSIZE + i * 4 + 2];
+		palette.rgb[i][1] = hdr[BMP_HDRSIZE + i * 4 + 1];
+		palette.rgb[i][2] = hdr[BMP_HDRSIZE + i * 4];
+	}
+	return 0;
+}
+
+/*
+ * Scale to 80x70 by averaging all source pixels whose centre lies in a
+ * destination pixel, falling back to the nearest pixel when enlarging.
+ */
+static void resample(const uint8_t *src, int w, int h, uint8_t dst[ICON_HEIGHT][ICON_WIDTH][3])
+{
+	for (int y = 0; y < ICON_HEIGHT; y++) {
+		int y0 = y * h / ICON_HEIGHT, y1 = MIN(h, (y + 1) * h / ICON_HEIGHT);
+
+		if (y1 <= y0)
+			y1 = y0 + 1;
+
+		for (int x = 0; x < ICON_WIDTH; x++) {
+			int x0 = x * w / ICON_WIDTH, x1 = MIN(w, (x + 1) * w / ICON_WIDTH);
+			uint32_t sum[3] = { 0 }, n;
+
+			if (x1 <= x0)
+				x1 = x0 + 1;
+
+			for (int sy = y0; sy < y1; sy++)
+				for (int sx = x0; sx < x1; sx++)
+					for (int c = 0; c < 3; c++)
+						sum[c] += src[(sy * w + sx) * 3 + c];
+
+			n = (y1 - y0) * (x1 - x0);
+			for (int c = 0; c < 3; c++)
+				dst[y][x][c] = (sum[c] + n / 2) / n;
+		}
+	}
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static int write_bmp(char *name, uint8_t pixels[ICON_HEIGHT][ICON_WIDTH])
+{
+	uint8_t bmp[BMP_FILESIZE] = { 0 };
+	char tmp[PATH_MAX + 8];
+	int fd;
+
+	bmp[0] = 'B';
+	bmp[1] = 'M';
+	put32(bmp + 2, BMP_FILESIZE);
+	put32(bmp + 10, BMP_BITSOFFSET);
+	put32(bmp + 14, 40);
+	put32(bmp + 18, ICON_WIDTH);
+	put32(bmp + 22, ICON_HEIGHT);
+	put16(bmp + 26, 1);
+	put16(bmp + 28, 8);
+	put32(bmp + 34, ICON_STRIDE * ICON_HEIGHT);
+	put32(bmp + 38, 2835);
+	put32(bmp + 42, 2835);
+	put32(bmp + 46, 256);
+
+	for (int i = 0; i < 256; i++) {
+		bmp[BMP_HDRSIZE + i * 4] = palette.rgb[i][2];
+		bmp[BMP_HDRSIZE + i * 4 + 1] = palette.rgb[i][1];
+		bmp[BMP_HDRSIZE + i * 4 + 2] = palette.rgb[i][0];
+	}
+
+	/* rows are stored bottom up */
+	for (int y = 0; y < ICON_HEIGHT; y++)
+		memcpy(bmp + BMP_BITSOFFSET + (ICON_HEIGHT - 1 - y) * ICON_STRIDE, pixels[y], ICON_WIDTH);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "open %s: %m\n", tmp);
+		return -1;
+	}
+
+	if (write(fd, bmp, sizeof(bmp)) != sizeof(bmp)) {
+		fprintf(stderr, "write %s: %m\n", tmp);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	return rename(tmp, name);
+}
+
+static void output_name(char *out, size_t len, struct icon *icon)
+{
+	char *dot = strrchr(icon->name, '.');
+
+	snprintf(out, len, "%s/%.*s.bmp", outdir, dot ? (int)(dot - icon->name) : (int)strlen(icon->name),
+		 icon->name);
+}
+
+static int convert(struct icon *icon)
+{
+	uint8_t scaled[ICON_HEIGHT][ICON_WIDTH][3], pixels[ICON_HEIGHT][ICON_WIDTH];
+	char path[PATH_MAX], out[PATH_MAX];
+	png_image image = { .version = PNG_IMAGE_VERSION };
+	struct stat statbuf;
+	uint8_t *src, *data;
+	int fd, ret = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", srcdir, icon->name);
+	output_name(out, sizeof(out), icon);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "open %s: %m\n", path);
+		return -1;
+	}
+
+	if (fstat(fd, &statbuf) == -1 || !statbuf.st_size) {
+		fprintf(stderr, "%s: empty or unreadable\n", path);
+		close(fd);
+		return -1;
+	}
+
+	data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "mmap %s: %m\n", path);
+		return -1;
+	}
+
+	icon->hash = fnv1a(0xcbf29ce484222325ULL, data, statbuf.st_size);
+	if (!force && icon->hash == icon->cached && access(out, F_OK) == 0) {
+		munmap(data, statbuf.st_size);
+		return 1;
+	}
+
+	if (!png_image_begin_read_from_memory(&image, data, statbuf.st_size)) {
+		fprintf(stderr, "%s: %s\n", path, image.message);
+		goto out_unmap;
+	}
+
+	image.format = PNG_FORMAT_RGB;
+	src = malloc(PNG_IMAGE_SIZE(image));
+	if (!src) {
+		fprintf(stderr, "%s: out of memory\n", path);
+		png_image_free(&image);
+		goto out_unmap;
+	}
+
+	/* transparent areas are composed onto the background colour */
+	if (!png_image_finish_read(&image, &background, src, 0, NULL)) {
+		fprintf(stderr, "%s: %s\n", path, image.message);
+		goto out_free;
+	}
+
+	resample(src, image.width, image.height, scaled);
+	for (int y = 0; y < ICON_HEIGHT; y++)
+		for (int x = 0; x < ICON_WIDTH; x++)
+			pixels[y][x] = nearest(scaled[y][x][0], scaled[y][x][1], scaled[y][x][2]);
+
+	ret = write_bmp(out, pixels);
+out_free:
+	free(src);
+out_unmap:
+	munmap(data, statbuf.st_size);
+	return ret;
+}
+
+static void *worker(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&lock);
+		i = nexticon++;
+		pthread_mutex_unlock(&lock);
+		if (i >= nicons)
+			break;
+		icons[i].status = convert(&icons[i]);
+	}
+	return NULL;
+}
+
+/* the cache also covers palette and background, they change every output */
+static uint64_t settings_hash(void)
+{
+	uint64_t hash = fnv1a(0xcbf29ce484222325ULL, palette.rgb, sizeof(palette.rgb));
+	int version = CACHE_VERSION;
+
+	hash = fnv1a(hash, &background, sizeof(background));
+	return fnv1a(hash, &version, sizeof(version));
+}
+
+static void load_cache(uint64_t settings)
+{
+	char path[PATH_MAX], name[256];
+	unsigned long long hash;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", outdir, CACHE_NAME);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	if (fscanf(f, "%llx\n", &hash) != 1 || hash != settings) {
+		fclose(f);
+		return;
+	}
+
+	while (fscanf(f, "%llx %255[^\n]\n", &hash, name) == 2) {
+		for (int i = 0; i < nicons; i++) {
+			if (!strcmp(icons[i].name, name)) {
+				icons[i].cached = hash;
+				break;
+			}
+		}
+	}
+	fclose(f);
+}
+
+static void save_cache(uint64_t settings)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", outdir, CACHE_NAME);
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "open %s: %m\n", path);
+		return;
+	}
+
+	fprintf(f, "%016llx\n", (unsigned long long)settings);
+	for (int i = 0; i < nicons; i++)
+		if (icons[i].status >= 0)
+			fprintf(f, "%016llx %s\n", (unsigned long long)icons[i].hash, icons[i].name);
+	fclose(f);
+}
+
+static int scan_sources(void)
+{
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(srcdir);
+	if (!dir) {
+		fprintf(stderr, "opendir %s: %m\n", srcdir);
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		char *dot = strrchr(de->d_name, '.');
+
+		if (!dot || strcasecmp(dot, ".png") || strlen(de->d_name) >= sizeof(icons[0].name))
+			continue;
+
+		if (nicons == MAX_ICONS) {
+			fprintf(stderr, "%s: more than %d icons\n", srcdir, MAX_ICONS);
+			break;
+		}
+		strcpy(icons[nicons++].name, de->d_name);
+	}
+	closedir(dir);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN), optidx, opt, converted = 0, failed = 0;
+	char *palettefile = NULL, *endp;
+	pthread_t threads[256];
+	unsigned long bg = 0;
+	uint64_t settings;
+
+	while ((opt = getopt_long(argc, argv, "hfj:p:b:", options, &optidx)) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = strtoul(optarg, &endp, 10);
+			if (*endp || !jobs) {
+				fprintf(stderr, "invalid number of jobs: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			palettefile = optarg;
+			break;
+		case 'b':
+			bg = strtoul(optarg, &endp, 16);
+			if (*endp) {
+				fprintf(stderr, "invalid background colour: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'f':
+			force = 1;
+			break;
+		case 'h':
+			fprintf(stderr, "%s: usage:%s <options> <srcdir> <outdir>\n"
+				"-j, --jobs <n>          number of conversion threads\n"
+				"-p, --palette <bmp>     take palette from keyboard icon\n"
+				"-b, --background <rgb>  colour for transparent areas, hex RRGGBB\n"
+				"-f, --force             ignore conversion cache\n",
+				argv[0], argv[0]);
+			return 0;
+		default:
+			break;
+		}
+	}
+
+	if (argc - optind != 2) {
+		fprintf(stderr, "%s: need source and output directory\n", argv[0]);
+		return 1;
+	}
+	srcdir = argv[optind];
+	outdir = argv[optind + 1];
+
+	if (palettefile) {
+		if (load_palette(palettefile) == -1)
+			return 1;
+	} else {
+		default_palette();
+	}
+
+	for (int i = 0; i < 256; i++) {
+		palette.r[i] = palette.rgb[i][0];
+		palette.g[i] = palette.rgb[i][1];
+		palette.b[i] = palette.rgb[i][2];
+	}
+
+	background.red = bg >> 16;
+	background.green = bg >> 8;
+	background.blue = bg;
+
+	nearest_init();
+
+	if (mkdir(outdir, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "mkdir %s: %m\n", outdir);
+		return 1;
+	}
+
+	if (scan_sources() == -1)
+		return 1;
+
+	settings = settings_hash();
+	load_cache(settings);
+
+	jobs = MIN(MIN(jobs, nicons), (int)(sizeof(threads) / sizeof(threads[0])));
+	for (int i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL)) {
+			fprintf(stderr, "pthread_create failed\n");
+			jobs = i;
+			break;
+		}
+	}
+	worker(NULL);
+	for (int i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+
+	for (int i = 0; i < nicons; i++) {
+		if (icons[i].status < 0)
+			failed++;
+		else if (!icons[i].status)
+			converted++;
+	}
+
+	save_cache(settings);
+	printf("%d icons: %d converted, %d unchanged, %d failed\n", nicons, converted,
+	       nicons - converted - failed, failed);
+	return failed ? 1 : 0;
+}
@@ -9,11 +9,33 @@
 #include <arpa/inet.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <stddef.h>
 #include <libusb-1.0/libusb.h>
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/serial.h>
+#ifdef WITH_FUSE
+#ifdef WEY_EMBEDDED
+#error "the FUSE frontend keeps whole files on the heap, it can't be built with WEY_EMBEDDED"
+#endif
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#endif
 
 static int kbfd = -1;
 static int verbose;
+/* identifies the keyboard for cached data, --id or the device name */
+static char kbd_key[64];
+/* the key was given with --id and names one keyboard, not just a port */
+static int kbd_named;
 
 libusb_device_handle *usbdev;
 
@@ -26,11 +48,123 @@ typedef enum {
 	HP_CMD_LISTFILES=0xa9,
 } hp_cmds_t;
 
+typedef enum {
+	HP_CMD_BRIGHTNESS=0x74,
+	HP_CMD_LAYER=0x78,
+	HP_CMD_PAGE=0x79,
+	HP_CMD_EXT=0x7f,
+} hp_lcd_cmds_t;
+
+typedef enum {
+	HP_EXT_SWITCH=0x14,
+	HP_EXT_ATTACH=0x19,
+	HP_EXT_GOTOXY=0x10,
+	HP_EXT_ATTR=0x11,
+	HP_EXT_LED=0x20,
+	HP_EXT_PRINT=0x30,
+} hp_ext_cmds_t;
+
 typedef enum {
 	OPT_RAWCMD = 0x100,
 	OPT_RAWRX,
+	OPT_DISPLAY,
+	OPT_CONTROL,
+	OPT_SCAN,
+	OPT_SCANDB,
+	OPT_MOUNT,
+	OPT_MONITOR,
+	OPT_METRICS,
+	OPT_GET,
+	OPT_ID,
+	OPT_TIMEOUT,
+#ifndef WEY_EMBEDDED
+	OPT_ROLLOUT,
+	OPT_ROLLOUT_LIMIT,
+#endif
 } optnum_t;
 
+/* libusb splits transfers into 64 byte packets itself */
+#define USB_TX_CHUNK 4096
+/* buffer sizes, the embedded build sets smaller ones */
+#ifndef RX_BUFSIZE
+#define RX_BUFSIZE 4096
+#endif
+#ifndef XFER_CHUNK
+#define XFER_CHUNK 16384
+#endif
+#if XFER_CHUNK < 64
+#error "XFER_CHUNK has to hold at least one LCD row"
+#endif
+/* -r, -w and -d each, the embedded build queues fewer */
+#ifdef WEY_EMBEDDED
+#define MAX_FILEOPS 16
+#else
+#define MAX_FILEOPS 64
+#endif
+/* requests kept in flight when the keyboard accepts pipelining */
+#define PIPE_WINDOW 4
+
+/* default wait for the first byte of a reply, --timeout */
+#define IO_TIMEOUT 3000
+/* longest pause within a reply */
+#define IO_GAP 500
+/* a line silent for this long is at a command boundary */
+#define IO_QUIET 50
+#define IO_DRAIN_MAX 2000
+#define IO_RETRIES 2
+
+#define FS_MAX_FILES 1024
+
+#define HP_CMD_READCONFIG 0xa4
+#define CONFIG_SHORT_SIZE 16
+/* the full config is read in one piece, the embedded build sets less */
+#ifndef CONFIG_MAX_SIZE
+#define CONFIG_MAX_SIZE 16384
+#endif
+#define CONFIG_MAGIC 0x47464357	/* "WCFG" */
+#define CONFIG_CACHE_TTL 3600
+#define MAX_GETS 16
+
+/* unchanged values are polled up to this many times less often */
+#define MON_MAX_BACKOFF 16
+#define MON_TIMEOUT 200
+#define MON_GAP 20
+
+#define MAX_KEYBOARDS 16
+
+#define ROLLOUT_MAX_JOBS 1024
+#define ROLLOUT_MAX_OPS 16
+#define ROLLOUT_MAX_GROUPS 64
+#define ROLLOUT_RETRIES 3
+/* first retry after this many ms, doubled for every further one */
+#define ROLLOUT_BACKOFF 5000
+/* fixed cost of a file operation, in bytes at the line rate */
+#define ROLLOUT_OP_BYTES 512
+#define MAX_SCANSPECS 16
+#define SCAN_MAXLEN 8
+#define SCAN_TIMEOUT 200
+#define SCAN_MIN_TIMEOUT 20
+#define SCAN_MAX_TIMEOUT 1000
+#define SCAN_GAP 20
+#define SCAN_PAD 4
+#define SCAN_SYNC_TRIES 3
+
+#define CTL_MAX_CLIENTS 8
+#define CTL_LINE 128
+/* detach from all workstations */
+#define CTL_DETACH 0x10
+
+/* geometry of the MK06 LCD as far as seen, override with -DLCD_ROWS/-DLCD_COLS */
+#ifndef LCD_ROWS
+#define LCD_ROWS 16
+#endif
+#ifndef LCD_COLS
+#define LCD_COLS 40
+#endif
+#define LCD_LEDS 5
+/* a new run costs gotoxy, print header and NUL, so reprint shorter gaps */
+#define LCD_GAP 9
+
 struct option options[] = {
 	{ "device", required_argument, 0, 'D' },
 	{ "baud", required_argument,   0, 'b' },
@@ -42,6 +176,23 @@ struct option options[] = {
 	{ "verbose", no_argument,      0, 'v' },
 	{ "rawcmd", required_argument, 0, OPT_RAWCMD },
 	{ "rawrx", required_argument,  0, OPT_RAWRX },
+	{ "display", no_argument,      0, OPT_DISPLAY },
+	{ "control", required_argument, 0, OPT_CONTROL },
+	{ "scan", required_argument,   0, OPT_SCAN },
+	{ "scan-db", required_argument, 0, OPT_SCANDB },
+#ifdef WITH_FUSE
+	{ "mount", required_argument,  0, OPT_MOUNT },
+#endif
+	{ "monitor", required_argument, 0, OPT_MONITOR },
+	{ "metrics", required_argument, 0, OPT_METRICS },
+	{ "get", required_argument,    0, OPT_GET },
+	{ "id", required_argument,     0, OPT_ID },
+	{ "timeout", required_argument, 0, OPT_TIMEOUT },
+#ifndef WEY_EMBEDDED
+	{ "rollout", required_argument, 0, OPT_ROLLOUT },
+	{ "rollout-limit", required_argument, 0, OPT_ROLLOUT_LIMIT },
+#endif
+	{ 0, 0, 0, 0 }
 };
 
 struct cmd_listfiles {
@@ -101,6 +252,208 @@ struct request_graphfileread {
 	uint32_t maxsize;
 } __attribute__((packed));
 
+struct request_graphfilewrite {
+	uint8_t cmd;
+	uint16_t magic;
+	uint16_t subindex;
+	uint32_t size;
+} __attribute__((packed));
+
+struct fileop {
+	int cmd;
+	int index;
+	int subindex;
+	char *spec;
+	char input[32];
+	int failed;
+	int tries;
+	/* a delete of a file that isn't there counts as done */
+	int missing_ok;
+};
+
+typedef enum {
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+} jobstate_t;
+
+struct rollout_job {
+	char *device;
+	int group;
+	struct fileop ops[ROLLOUT_MAX_OPS];
+	int nops;
+	long cost;
+	jobstate_t state;
+	pid_t pid;
+	long start;
+	long next_try;
+	int tries;
+};
+
+struct rollout_group {
+	char name[32];
+	int limit;
+	int running;
+};
+
+struct ctl_client {
+	int in;
+	int out;
+	char line[CTL_LINE];
+	size_t len;
+};
+
+struct ctl_stats {
+	long count;
+	long min_us;
+	long max_us;
+	long total_us;
+};
+
+struct scanspec {
+	int len;
+	uint8_t lo[SCAN_MAXLEN];
+	uint8_t hi[SCAN_MAXLEN];
+};
+
+struct scanresult {
+	uint8_t cmd[SCAN_MAXLEN];
+	int cmdlen;
+	int replylen;
+	long latency;
+	uint8_t reply[1024];
+};
+
+/* commands which erase or overwrite keyboard state, never probed */
+static const struct {
+	int len;
+	uint8_t prefix[2];
+} scan_denylist[] = {
+	{ 1, { 0x78 } },		/* set layer and save */
+	{ 2, { 0x7f, 0x15 } },		/* clear page */
+	{ 2, { 0x7f, 0x16 } },		/* copy layer */
+	{ 2, { 0x7f, 0x60 } },		/* write bmp file */
+	{ 2, { 0x7f, 0xe0 } },		/* unlock special functions */
+	{ 2, { 0x7f, 0xe4 } },		/* reboot */
+	{ 2, { 0x7f, 0xe7 } },		/* delete files, LED test */
+	{ 2, { 0x7f, 0xea } },		/* start test / reinstall fs */
+	{ 2, { 0x7f, 0xec } },		/* write product data */
+	{ 2, { 0x7f, 0xee } },		/* start bootloader */
+	{ 2, { 0x7f, 0xf0 } },		/* terminal mode */
+	{ 2, { 0xa0, 0x40 } },		/* download connectorbox firmware */
+	{ 2, { 0xa0, 0x50 } },		/* download layer file */
+	{ 2, { 0xa0, 0x51 } },
+	{ 2, { 0xa0, 0x52 } },
+	{ 2, { 0xa0, 0x54 } },		/* download bmp file */
+	{ 2, { 0xa0, 0x56 } },		/* download wav file */
+	{ 2, { 0xa0, 0x57 } },		/* download setup file */
+	{ 2, { 0xa0, 0x5a } },		/* download kct file */
+	{ 2, { 0xa0, 0x5b } },		/* download usertext */
+	{ 2, { 0xa0, 0x5c } },		/* clear global pin */
+	{ 2, { 0xa0, 0x60 } },		/* download bmp file */
+	{ 2, { 0xa0, 0x61 } },		/* download buzzer patterns */
+	{ 1, { HP_CMD_WRITEGRAPH } },
+	{ 1, { HP_CMD_WRITEFILE } },
+	{ 1, { 0xa7 } },		/* undocumented, next to the file commands */
+	{ 1, { HP_CMD_DELETE } },
+};
+
+/*
+ * Argument bytes of known commands. Probes are padded with zeros to the
+ * full length, so the keyboard doesn't take the next probe as arguments.
+ */
+static const struct {
+	int len;
+	uint8_t prefix[2];
+	int args;
+} scan_args[] = {
+	{ 1, { 0x70 }, 1 },
+	{ 1, { 0x72 }, 1 },
+	{ 1, { 0x74 }, 1 },
+	{ 1, { 0x75 }, 1 },
+	{ 1, { 0x76 }, 1 },
+	{ 1, { 0x77 }, 1 },
+	{ 1, { 0x79 }, 1 },
+	{ 1, { 0x7a }, 3 },
+	{ 1, { 0x7d }, 1 },
+	{ 1, { HP_CMD_READCONFIG }, 1 },
+	{ 1, { HP_CMD_READFILE }, 4 },
+	{ 1, { HP_CMD_LISTFILES }, 3 },
+	{ 2, { 0x7f, 0x10 }, 3 },
+	{ 2, { 0x7f, 0x11 }, 2 },
+	{ 2, { 0x7f, 0x12 }, 1 },
+	{ 2, { 0x7f, 0x13 }, 1 },
+	{ 2, { 0x7f, 0x14 }, 2 },
+	{ 2, { 0x7f, 0x18 }, 2 },
+	{ 2, { 0x7f, 0x19 }, 1 },
+	{ 2, { 0x7f, 0x20 }, 2 },
+	{ 2, { 0x7f, 0x21 }, 1 },
+	{ 2, { 0x7f, 0x30 }, 2 },	/* position and an empty string */
+	{ 2, { 0x7f, 0x41 }, 2 },
+	{ 2, { 0x7f, 0xe3 }, 2 },
+};
+
+struct mon_query {
+	const char *name;
+	uint8_t cmd[2];
+	int text;
+};
+
+static const struct mon_query mon_queries[] = {
+	{ "id", { 0x7f, 0xe8 }, 1 },
+	{ "modules", { 0x7f, 0xe9 }, 1 },
+	{ "test_status", { 0x7f, 0x5c }, 0 },
+	{ "brightness", { 0x7f, 0xe2 }, 0 },
+};
+
+#define MON_QUERIES (sizeof(mon_queries) / sizeof(mon_queries[0]))
+
+struct mon_value {
+	uint8_t data[256];
+	int len;
+	int valid;
+	int interval;
+	long due;
+	long changed;
+};
+
+struct mon_keyboard {
+	const char *name;
+	int fd;
+	int up;
+	struct mon_value values[MON_QUERIES];
+};
+
+static volatile sig_atomic_t stop;
+
+static void stop_handler(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+struct kbd_config {
+	uint32_t magic;
+	int32_t fulllen;	/* -1 until the full config was read */
+	uint8_t shortcfg[CONFIG_SHORT_SIZE];
+	uint8_t full[CONFIG_MAX_SIZE];
+};
+
+struct config_field {
+	int full;
+	int offset;
+	int width;	/* 1, 2 or 4: big endian number, 0: hex up to the end */
+};
+
+struct display {
+	char text[LCD_ROWS][LCD_COLS];
+	uint8_t attr[LCD_ROWS][LCD_COLS];
+	uint8_t led[LCD_LEDS];
+	int brightness;
+	int valid;
+};
+
 
 static void hexdump_line(char *out, uint8_t *buf, size_t len)
 {
@@ -169,85 +522,172 @@ err:
 	return -1;
 }
 
-static ssize_t read_serial(int fd, void *buf, ssize_t count)
+/* transport state, see io_budget() and resync() */
+static int io_timeout = IO_TIMEOUT;
+static long io_deadline;
+static int io_byte_us = 10;
+static int io_failed;
+static size_t io_owed;
+/* the upload io_owed belongs to */
+static struct {
+	int cmd;
+	int index;
+	int subindex;
+} io_upload;
+
+static long now_ms(void)
 {
-	ssize_t ret, total = 0;
+	struct timespec ts;
 
-	do {
-		ret = read(fd, buf, count);
-		if (ret == -1) {
-			fprintf(stderr, "%s: %m\n", __func__);
-			return -1;
-		}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-		if (!ret) {
-			fprintf(stderr, "%s: unexpected EOF\n", __func__);
-			return -1;
-		}
+/*
+ * Limit the current operation to the time needed to move size bytes
+ * at the line rate, twice over, on top of the usual reply latency.
+ */
+static void io_budget(size_t size)
+{
+	/* only operations run through retry() have a deadline */
+	if (io_deadline)
+		io_deadline = now_ms() + io_timeout + (long)(size * io_byte_us / 500);
+}
+
+/* how long the next wait may take without overrunning the operation */
+static int io_wait(int wait)
+{
+	long left;
+
+	if (!io_deadline)
+		return wait;
+	left = io_deadline - now_ms();
+	return left <= 0 ? 0 : MIN(wait, left);
+}
+
+static uint8_t tmpbuf[RX_BUFSIZE];
+static size_t rxavailable;
 
-		if (ret > 0) {
-			buf += ret;
-			count -= ret;
+/*
+ * Receive up to count bytes, waiting at most timeout ms for the first
+ * byte and gap ms for each following one. Returns the number of bytes
+ * received, 0 if the keyboard stayed silent.
+ */
+static int read_keyboard_timeout(void *buf, size_t count, int timeout, int gap)
+{
+	struct pollfd pfd = { .fd = kbfd, .events = POLLIN };
+	size_t total = 0;
+	int sent, ret, wait;
+
+	while (total < count) {
+		wait = io_wait(total ? gap : timeout);
+		if (io_deadline && !wait)
+			break;
+
+		if (kbfd != -1) {
+			ret = poll(&pfd, 1, wait);
+			if (ret == -1) {
+				fprintf(stderr, "%s: poll: %m\n", __func__);
+				return -1;
+			}
+			if (!ret)
+				break;
+
+			ret = read(kbfd, buf + total, count - total);
+			if (ret <= 0) {
+				fprintf(stderr, "%s: %s\n", __func__, ret ? strerror(errno) : "unexpected EOF");
+				io_failed = 1;
+				return -1;
+			}
 			total += ret;
+			continue;
 		}
-	} while (count > 0);
+
+		if (!rxavailable) {
+			/* libusb treats 0 as no timeout at all */
+			ret = libusb_bulk_transfer(usbdev, 0x85, tmpbuf, sizeof(tmpbuf), &sent,
+						   MAX(1, wait));
+			if (ret == LIBUSB_ERROR_TIMEOUT && !sent)
+				break;
+			if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_TIMEOUT) {
+				fprintf(stderr, "%s: %s\n", __func__, libusb_strerror(ret));
+				io_failed = 1;
+				errno = EIO;
+				return -1;
+			}
+			rxavailable = sent;
+		}
+
+		ret = MIN(rxavailable, count - total);
+		memcpy(buf + total, tmpbuf, ret);
+		memmove(tmpbuf, tmpbuf + ret, rxavailable - ret);
+		rxavailable -= ret;
+		total += ret;
+	}
+
+	hexdump("RX", buf, total);
 	return total;
 }
 
+/* receive exactly count bytes, a silent or stalled keyboard is an error */
 static int read_keyboard(void *buf, size_t count)
 {
-	static uint8_t tmpbuf[4096];
-	static size_t rxavailable;
-	int sent, ret;
-
-	if (kbfd != -1)
-		return read_serial(kbfd, buf, count);
+	int ret;
 
-	if (count > sizeof(tmpbuf))
-		count = sizeof(tmpbuf);
+	ret = read_keyboard_timeout(buf, count, io_timeout, IO_GAP);
+	if (ret == -1)
+		return -1;
 
-	while(rxavailable < count) {
-		ret = libusb_bulk_transfer(usbdev, 0x85, tmpbuf + rxavailable,
-					   sizeof(tmpbuf) - rxavailable, &sent, 60000);
-		switch (ret) {
-		case LIBUSB_SUCCESS:
-			rxavailable += sent;
-			break;
-		default:
-			fprintf(stderr, "%s: %s\n", __func__, libusb_strerror(ret));
-			errno = EIO;
-			return -1;
-		}
+	if ((size_t)ret < count) {
+		fprintf(stderr, "%s: timeout, got %d of %zu bytes\n", __func__, ret, count);
+		io_failed = 1;
+		errno = ETIMEDOUT;
+		return -1;
 	}
-
-	rxavailable -= count;
-	memcpy(buf, tmpbuf, count);
-	hexdump("RX", buf, count);
-	memmove(tmpbuf, tmpbuf + count, rxavailable);
-	return count;
+	return ret;
 }
 
 static int write_keyboard(void *buf, size_t count)
 {
+	struct pollfd pfd = { .fd = kbfd, .events = POLLOUT };
 	int sent, ret, total = 0;
 
 	hexdump("TX", buf, count);
-	if (kbfd != -1)
-		return write(kbfd, buf, count);
-	do {
-		ret = libusb_bulk_transfer(usbdev, 0x06, buf, MIN(count, 64), &sent, 60000);
-		switch (ret) {
-		case LIBUSB_SUCCESS:
-			count -= sent;
-			buf += sent;
-			total += sent;
-			break;
-		default:
-			fprintf(stderr, "%s: %s, sent %d\n", __func__, libusb_strerror(ret), sent);
-			errno = EIO;
-			return -1;
+	while (count) {
+		if (kbfd != -1) {
+			ret = poll(&pfd, 1, io_wait(io_timeout));
+			if (ret == -1) {
+				fprintf(stderr, "%s: poll: %m\n", __func__);
+				return -1;
+			}
+			if (!ret) {
+				fprintf(stderr, "%s: timeout, sent %d\n", __func__, total);
+				io_failed = 1;
+				errno = ETIMEDOUT;
+				return -1;
+			}
+
+			sent = write(kbfd, buf, count);
+			if (sent == -1) {
+				fprintf(stderr, "%s: %m\n", __func__);
+				io_failed = 1;
+				return -1;
+			}
+		} else {
+			ret = libusb_bulk_transfer(usbdev, 0x06, buf, MIN(count, USB_TX_CHUNK), &sent,
+						   MAX(1, io_wait(io_timeout)));
+			if (ret != LIBUSB_SUCCESS) {
+				fprintf(stderr, "%s: %s, sent %d\n", __func__, libusb_strerror(ret),
+					total + sent);
+				io_failed = 1;
+				errno = ret == LIBUSB_ERROR_TIMEOUT ? ETIMEDOUT : EIO;
+				return -1;
+			}
 		}
-	} while(count);
+		count -= sent;
+		buf += sent;
+		total += sent;
+	}
 
 	return total;
 }
@@ -260,76 +700,220 @@ static int enter_usb_mode(void)
 }
 
 
-static int listfiles(void)
+static int cache_path(char *out, size_t len, const char *what)
+{
+	char *base = getenv("XDG_CACHE_HOME"), dir[PATH_MAX / 2];
+	char name[64];
+	size_t i;
+
+	if (!kbd_key[0])
+		return -1;
+
+	if (base && *base) {
+		snprintf(dir, sizeof(dir), "%s/weytools", base);
+	} else {
+		base = getenv("HOME");
+		if (!base)
+			return -1;
+		snprintf(dir, sizeof(dir), "%s/.cache", base);
+		mkdir(dir, 0755);
+		snprintf(dir, sizeof(dir), "%s/.cache/weytools", base);
+	}
+	mkdir(dir, 0755);
+
+	for (i = 0; kbd_key[i] && i < sizeof(name) - 1; i++)
+		name[i] = isalnum((unsigned char)kbd_key[i]) || kbd_key[i] == '-' ? kbd_key[i] : '_';
+	name[i] = '\0';
+
+	snprintf(out, len, "%s/%s-%s", dir, what, name);
+	return 0;
+}
+
+/*
+ * The configuration is only cached for keyboards named with --id, a
+ * device name or "usb" may lead to another keyboard next time.
+ */
+static int config_path(char *out, size_t len)
+{
+	if (!kbd_named)
+		return -1;
+	return cache_path(out, len, "config");
+}
+
+/* index 1 holds the system configuration */
+static void config_invalidate(void)
+{
+	char path[PATH_MAX];
+
+	if (config_path(path, sizeof(path)) == 0)
+		unlink(path);
+}
+
+static int send_listing(void)
 {
 	struct cmd_listfiles request = { .cmd = HP_CMD_LISTFILES, { 0 } };
-	struct reply_listfile reply;
-	struct fileentry *entries;
-	int count, pktlen;
 
 	if (write_keyboard(&request, sizeof(request)) == -1) {
 		fprintf(stderr, "%s: send request: %m\n", __func__);
 		return -1;
 	}
+	return 0;
+}
+
+/* receive the header of a listing, returns the number of entries following */
+static int recv_listing_header(void)
+{
+	struct reply_listfile reply;
+	int count;
 
 	if (read_keyboard(&reply, sizeof(reply)) == -1) {
 		fprintf(stderr, "%s: receive header: %m\n", __func__);
 		return -1;
 	}
 
+	if (reply.cmd != HP_CMD_LISTFILES) {
+		fprintf(stderr, "%s: out of sync: %02x\n", __func__, reply.cmd);
+		io_failed = 1;
+		return -1;
+	}
+
 	count = htonl(reply.count);
-	pktlen = count * sizeof(*entries);
-	if (!pktlen || pktlen > 1048576) {
-		fprintf(stderr, "unexpected pktlen: %d\n", pktlen);
+	if (count <= 0 || count > 1048576 / (int)sizeof(struct fileentry)) {
+		fprintf(stderr, "unexpected number of entries: %d\n", count);
+		io_failed = 1;
+		return -1;
+	}
+
+	io_budget(count * sizeof(struct fileentry));
+	return count;
+}
+
+static int recv_entry(struct fileentry *entry)
+{
+	if (read_keyboard(entry, sizeof(*entry)) == -1) {
+		fprintf(stderr, "%s: receive entry: %m\n", __func__);
 		return -1;
 	}
+	entry->name[sizeof(entry->name) - 1] = '\0';
+	return 0;
+}
 
-	entries = malloc(pktlen);
-	if (!entries) {
+#ifdef WITH_FUSE
+/* fetch the directory, the caller frees the returned entries */
+static int get_listing(struct fileentry **entries)
+{
+	int count;
+
+	if (send_listing() == -1)
+		return -1;
+
+	count = recv_listing_header();
+	if (count == -1)
+		return -1;
+
+	*entries = malloc(count * sizeof(**entries));
+	if (!*entries) {
 		fprintf(stderr, "out of memory\n");
 		return -1;
 	}
 
-	if (read_keyboard(entries, pktlen) == -1) {
-		fprintf(stderr, "%s: receive header: %m\n", __func__);
-		free(entries);
+	for (int i = 0; i < count; i++) {
+		if (recv_entry(&(*entries)[i]) == -1) {
+			free(*entries);
+			return -1;
+		}
+	}
+	return count;
+}
+#endif
+
+/* look for a file in the listing, 1 if it is there, 0 if not */
+static int file_exists(int index, int subindex)
+{
+	struct fileentry entry;
+	int count, found = 0;
+
+	if (send_listing() == -1)
+		return -1;
+
+	count = recv_listing_header();
+	if (count == -1)
 		return -1;
+
+	/* read the whole listing to stay in sync */
+	for (int i = 0; i < count; i++) {
+		if (recv_entry(&entry) == -1)
+			return -1;
+		if (ntohs(entry.index) == index && ntohs(entry.subindex) == subindex)
+			found = 1;
 	}
+	return found;
+}
+
+/* entries are printed as they arrive, however long the directory is */
+static int listfiles(char *unused)
+{
+	struct fileentry entry;
+	int count;
+
+	(void)unused;
+	if (send_listing() == -1)
+		return -1;
+
+	count = recv_listing_header();
+	if (count == -1)
+		return -1;
 
 	printf("Number Index SubIndex Name\n");
-	for (int i = 0; i < count; i++)
-		printf("%6d %5d %8d %s\n", i, htons(entries[i].index), htons(entries[i].subindex), entries[i].name);
-	free(entries);
+	for (int i = 0; i < count; i++) {
+		if (recv_entry(&entry) == -1)
+			return -1;
+		printf("%6d %5d %8d %s\n", i, htons(entry.index), htons(entry.subindex), entry.name);
+	}
 	return 0;
 }
 
-static int readgraphfile(int index, int subindex)
+/*
+ * Map file index/subindex to the magic and slot used by a2/a3. Icons at
+ * index 5 have no known magic, they are plain a5/a6 files.
+ */
+static int graph_magic(int index, int subindex, uint16_t *magic, uint16_t *slot)
 {
-	struct request_graphfileread request;
-	int outfd, ret = -1;
-	char buf[512];
-	uint8_t status;
-	uint32_t size;
-	ssize_t len;
-	char name[32];
-	char dummy[8];
-	int total;
-
 	switch (index) {
 	case 4:
-		request.magic = htons(0xa054);
-		request.subindex = htons((subindex + 0x70) << 8);
-		sprintf(name, "BMP%d.BMP", subindex);
-		break;
+		*magic = 0xa054;
+		*slot = (subindex + 0x70) << 8;
+		return 0;
 	case 6:
-		request.magic = htons(0x0101);
-		request.subindex = htons(subindex);
-		strcpy(name, "Colorparm.par");
-		break;
+		*magic = 0x0101;
+		*slot = subindex;
+		return 0;
 	default:
 		return -1;
 	}
+}
+
+/*
+ * Request a graphics file. On success the caller has to receive the
+ * *size bytes of file data which follow.
+ */
+static int request_graphfile(int index, int subindex, char *name, uint32_t *size)
+{
+	struct request_graphfileread request;
+	uint8_t status;
+	char dummy[8];
+	uint16_t magic, slot;
+
+	if (graph_magic(index, subindex, &magic, &slot) == -1)
+		return -1;
+
+	if (index == 4)
+		sprintf(name, "BMP%d.BMP", subindex);
+	else
+		strcpy(name, "Colorparm.par");
 
+	request.magic = htons(magic);
+	request.subindex = htons(slot);
 	request.cmd = HP_CMD_READGRAPH;
 	request.maxsize = htonl(1000000);
 	if (write_keyboard(&request, sizeof(request)) == -1) {
@@ -343,7 +927,7 @@ static int readgraphfile(int index, int subindex)
 	}
 
 	if (status != HP_CMD_READGRAPH) {
-		fprintf(stderr, "%s: failed: %02x\n", __func__, ntohs(status));
+		fprintf(stderr, "%s: failed: %02x\n", __func__, status);
 		return -1;
 	}
 
@@ -353,53 +937,18 @@ static int readgraphfile(int index, int subindex)
 		return -1;
 	}
 
-	if (read_keyboard(&size, sizeof(size)) == -1) {
+	if (read_keyboard(size, sizeof(*size)) == -1) {
 		fprintf(stderr, "%s: receive header: %m\n", __func__);
 		return -1;
 	}
 
-	size = ntohl(size);
-	total = size;
-	printf("%s: %d bytes\n", name, size);
-
-	outfd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0644);
-	if (outfd == -1) {
-		fprintf(stderr, "%s: failed to create output file %s: %m\n", __func__, name);
-		return -1;
-	}
-
-	do {
-		len = read_keyboard(buf, MIN(sizeof(buf), size));
-		if (len == -1)
-			goto out;
-		if (write(outfd, buf, len) == -1)
-			goto out;
-		size -= len;
-		printf("%5.1f%% done\r", ((float)(total - size) / (float)total) * 100);
-	} while(size > 0);
-	printf("\n");
-	ret = 0;
-out:
-	close(outfd);
-	return ret;
+	*size = ntohl(*size);
+	return 0;
 }
 
-static int readfile(char *spec)
+static int send_read(int index, int subindex)
 {
 	struct request_fileread request;
-	struct reply_fileop reply;
-	struct reply_fileread reply2;
-	int index, subindex, outfd, ret = -1, size;
-	char buf[512];
-	ssize_t len;
-
-	if (sscanf(spec, "%d,%d", &index, &subindex) != 2) {
-		fprintf(stderr, "%s: invalid spec: %s\n", __func__, spec);
-		return -1;
-	}
-
-	if (index == 4 || index == 6)
-		return readgraphfile(index, subindex);
 
 	request.index = htons(index);
 	request.subindex = htons(subindex);
@@ -409,204 +958,2537 @@ static int readfile(char *spec)
 		fprintf(stderr, "%s: send request: %m\n", __func__);
 		return -1;
 	}
+	return 0;
+}
 
-	if (read_keyboard(&reply, sizeof(reply)) == -1) {
-		fprintf(stderr, "%s: receive header: %m\n", __func__);
-		return -1;
-	}
+/*
+ * Complete the header of a read reply. On success the name overlaps the
+ * status field of reply, an error status starts with d0.
+ */
+static int read_header(struct reply_fileop *reply, char *name, uint32_t *size)
+{
+	struct reply_fileread reply2;
 
-	if (reply.cmd != HP_CMD_READFILE || ntohs(reply.status) >> 8 == 0xd0) {
-		fprintf(stderr, "%s: failed: %04x\n", __func__, ntohs(reply.status));
+	if (ntohs(reply->status) >> 8 == 0xd0) {
+		fprintf(stderr, "%s: %d,%d: failed: %04x\n", __func__, ntohs(reply->index),
+			ntohs(reply->subindex), ntohs(reply->status));
 		return -1;
 	}
 
-	reply2.name[0] = ((uint8_t *)&reply.status)[0];
-	reply2.name[1] = ((uint8_t *)&reply.status)[1];
+	reply2.name[0] = ((uint8_t *)&reply->status)[0];
+	reply2.name[1] = ((uint8_t *)&reply->status)[1];
 
 	if (read_keyboard(&reply2.name[2], sizeof(reply2)-2) == -1) {
 		fprintf(stderr, "%s: receive header2: %m\n", __func__);
 		return -1;
 	}
 
-	size = htonl(reply2.size);
-	printf("%d,%d: %s %d bytes\n", ntohs(reply.index), ntohs(reply.subindex), reply2.name, size);
+	memcpy(name, reply2.name, sizeof(reply2.name));
+	name[sizeof(reply2.name) - 1] = '\0';
+	*size = htonl(reply2.size);
+	return 0;
+}
+
+/*
+ * Request a file, name has to hold 32 bytes. On success the caller has
+ * to receive the *size bytes of file data which follow.
+ */
+static int request_file(int index, int subindex, char *name, uint32_t *size)
+{
+	struct reply_fileop reply;
+
+	if (index == 4 || index == 6)
+		return request_graphfile(index, subindex, name, size);
+
+	if (send_read(index, subindex) == -1)
+		return -1;
+
+	if (read_keyboard(&reply, sizeof(reply)) == -1) {
+		fprintf(stderr, "%s: receive header: %m\n", __func__);
+		return -1;
+	}
+
+	if (reply.cmd != HP_CMD_READFILE) {
+		fprintf(stderr, "%s: out of sync: %02x\n", __func__, reply.cmd);
+		io_failed = 1;
+		return -1;
+	}
+	return read_header(&reply, name, size);
+}
+
+/* store the size bytes of file data following a read reply as name */
+static int receive_file(int index, int subindex, const char *name, uint32_t size)
+{
+	uint32_t total = size;
+	int outfd, ret = -1;
+	char buf[512];
+	ssize_t len;
 
-	outfd = open(reply2.name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	io_budget(size);
+	printf("%d,%d: %s %d bytes\n", index, subindex, name, size);
+
+	outfd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0644);
 	if (outfd == -1) {
-		fprintf(stderr, "%s: failed to create output file %s: %m\n", __func__, reply2.name);
+		fprintf(stderr, "%s: failed to create output file %s: %m\n", __func__, name);
 		return -1;
 	}
 
-	do {
+	while (size > 0) {
 		len = read_keyboard(buf, MIN(sizeof(buf), size));
 		if (len == -1)
 			goto out;
 		if (write(outfd, buf, len) == -1)
 			goto out;
 		size -= len;
-	} while(size > 0);
+		printf("%5.1f%% done\r", ((float)(total - size) / (float)total) * 100);
+	}
+	printf("\n");
 	ret = 0;
 out:
 	close(outfd);
 	return ret;
 }
 
-static int deletefile(char *spec)
+static int readfile(char *spec)
 {
-	struct request_filedelete request;
-	struct reply_fileop reply;
-	int index, subindex, ret = -1;
+	int index, subindex;
+	uint32_t size;
+	char name[32];
 
 	if (sscanf(spec, "%d,%d", &index, &subindex) != 2) {
 		fprintf(stderr, "%s: invalid spec: %s\n", __func__, spec);
 		return -1;
 	}
 
+	if (request_file(index, subindex, name, &size) == -1)
+		return -1;
+	return receive_file(index, subindex, name, size);
+}
+
+static int send_delete(int index, int subindex)
+{
+	struct request_filedelete request;
+
+	if (index == 1)
+		config_invalidate();
+
 	request.index = htons(index);
 	request.subindex = htons(subindex);
 	request.cmd = HP_CMD_DELETE;
 
-	if (write_keyboard(&request, sizeof(request)) == -1) {
-		fprintf(stderr, "%s: send request: %m\n", __func__);
+	if (write_keyboard(&request, sizeof(request)) == -1) {
+		fprintf(stderr, "%s: send request: %m\n", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+static int delete_file(int index, int subindex)
+{
+	struct reply_fileop reply;
+
+	if (send_delete(index, subindex) == -1)
+		return -1;
+
+	if (read_keyboard(&reply, sizeof(reply)) == -1) {
+		fprintf(stderr, "%s: receive header: %m\n", __func__);
+		return -1;
+	}
+
+	if (reply.cmd != HP_CMD_DELETE) {
+		fprintf(stderr, "%s: out of sync: %02x\n", __func__, reply.cmd);
+		io_failed = 1;
+		return -1;
+	}
+
+	if (ntohs(reply.status) != 0xd000) {
+		fprintf(stderr, "%s: delete failed: %04x\n", __func__,
+			ntohs(reply.status));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Get back to a command boundary after a failed operation: finish an
+ * upload the keyboard still expects data for, drop buffered input and
+ * read until the line stays quiet. An upload can't be aborted, so the
+ * zero padded file is deleted again. If that doesn't work the keyboard
+ * is not considered recovered.
+ */
+static int resync(void)
+{
+	static uint8_t zero[MIN(USB_TX_CHUNK, XFER_CHUNK)];
+	int padded = io_owed != 0;
+	uint8_t buf[256];
+	long end;
+	int ret;
+
+	io_deadline = 0;
+	while (io_owed) {
+		ret = write_keyboard(zero, MIN(io_owed, sizeof(zero)));
+		if (ret == -1) {
+			fprintf(stderr, "%s: keyboard stopped accepting data\n", __func__);
+			io_owed = 0;
+			return -1;
+		}
+		io_owed -= ret;
+	}
+
+	rxavailable = 0;
+	if (kbfd != -1)
+		tcflush(kbfd, TCIFLUSH);
+
+	end = now_ms() + IO_DRAIN_MAX;
+	do {
+		ret = read_keyboard_timeout(buf, sizeof(buf), IO_QUIET, IO_QUIET);
+		if (ret == -1)
+			return -1;
+	} while (ret && now_ms() < end);
+
+	if (ret) {
+		fprintf(stderr, "%s: keyboard keeps sending\n", __func__);
+		return -1;
+	}
+
+	if (!padded)
+		return 0;
+
+	/* a2 uploads have no file to delete */
+	if (io_upload.cmd == HP_CMD_WRITEGRAPH) {
+		fprintf(stderr, "%s: a2:%04x,%04x: interrupted upload left zero padded data\n",
+			__func__, io_upload.index, io_upload.subindex);
+		return -1;
+	}
+
+	io_failed = 0;
+	io_deadline = now_ms() + io_timeout;
+	ret = delete_file(io_upload.index, io_upload.subindex);
+	io_deadline = 0;
+	if (ret == -1) {
+		fprintf(stderr, "%s: %d,%d: interrupted upload left zero padded data\n",
+			__func__, io_upload.index, io_upload.subindex);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Run an idempotent file operation and repeat it after a transport
+ * failure. Errors reported by the keyboard or on local files are final.
+ */
+static int retry(int (*op)(char *), char *arg, const char *what)
+{
+	int ret;
+
+	for (int attempt = 1; ; attempt++) {
+		io_failed = 0;
+		io_deadline = now_ms() + io_timeout;
+		ret = op(arg);
+		io_deadline = 0;
+		if (ret != -1 || !io_failed || attempt > IO_RETRIES)
+			return ret;
+
+		fprintf(stderr, "%s%s%s: transport failed, retry %d of %d\n",
+			what, arg ? " " : "", arg ? arg : "", attempt, IO_RETRIES);
+		if (resync() == -1)
+			return -1;
+	}
+}
+
+/*
+ * Start a file upload: a5 with name for regular files, a2 for graphics,
+ * where index and subindex carry magic and slot. The caller sends size
+ * bytes of data and collects the reply with write_reply().
+ */
+static int write_request(int cmd, int index, int subindex, const char *name, uint32_t size)
+{
+	struct request_graphfilewrite grequest;
+	struct request_filewrite request;
+
+	if ((cmd == HP_CMD_WRITEFILE && index == 1) || (cmd == HP_CMD_WRITEGRAPH && index == 0x0901))
+		config_invalidate();
+
+	io_upload.cmd = cmd;
+	io_upload.index = index;
+	io_upload.subindex = subindex;
+
+	if (cmd == HP_CMD_WRITEGRAPH) {
+		grequest.cmd = HP_CMD_WRITEGRAPH;
+		grequest.magic = htons(index);
+		grequest.subindex = htons(subindex);
+		grequest.size = htonl(size);
+		return write_keyboard(&grequest, sizeof(grequest));
+	}
+
+	memset(&request, 0, sizeof(request));
+	strncpy(request.filename, name, sizeof(request.filename)-1);
+	request.index = htons(index);
+	request.subindex = htons(subindex);
+	request.size = htonl(size);
+	request.cmd = HP_CMD_WRITEFILE;
+	return write_keyboard(&request, sizeof(request));
+}
+
+static int write_reply(int cmd, const char *name)
+{
+	struct reply_fileop reply;
+
+	if (read_keyboard(&reply, sizeof(reply)) == -1)
+		return -1;
+
+	if (reply.cmd != cmd) {
+		fprintf(stderr, "%s: %s: out of sync: %02x\n", __func__, name, reply.cmd);
+		io_failed = 1;
+		return -1;
+	}
+
+	if (ntohs(reply.status) != 0xd000) {
+		fprintf(stderr, "%s: %s: failed: %04x\n", __func__,
+			name, ntohs(reply.status));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stream total bytes of infd to the keyboard in large chunks. A local
+ * read error is final, the keyboard is brought back to a command
+ * boundary here. Transport errors set io_failed and are left to retry().
+ */
+static int send_file(int infd, ssize_t total)
+{
+	static uint8_t buf[XFER_CHUNK];
+	ssize_t ret;
+
+	io_owed = total;
+	do {
+		ret = read(infd, buf, MIN(total, (ssize_t)sizeof(buf)));
+		if (ret <= 0) {
+			if (ret == -1)
+				fprintf(stderr, "%s: read: %m\n", __func__);
+			else
+				fprintf(stderr, "%s: file truncated, %ld bytes missing\n", __func__, total);
+			resync();
+			io_failed = 0;
+			return -1;
+		}
+
+		ret = write_keyboard(buf, ret);
+		if (ret == -1) {
+			fprintf(stderr, "%s: send request: %m\n", __func__);
+			io_failed = 1;
+			return -1;
+		}
+
+		total -= ret;
+		io_owed = total;
+		fprintf(stderr, "sent %ld bytes, %ld remaining\n", ret, total);
+	} while(total > 0);
+	return 0;
+}
+
+/*
+ * Files of every index, the graphics at index 4 and 6 included, are
+ * written with a5. The a2 graphics download is only used when asked for
+ * with a2:MAGIC,SLOT,FILE, its reply and status are not verified yet.
+ */
+static int parse_writespec(char *spec, int *cmd, int *index, int *subindex, char *input)
+{
+	unsigned int magic, slot;
+	int pos = 0;
+
+	*cmd = HP_CMD_WRITEFILE;
+	if (sscanf(spec, "a2:%x,%x,%31s%n", &magic, &slot, input, &pos) == 3) {
+		*cmd = HP_CMD_WRITEGRAPH;
+		*index = magic;
+		*subindex = slot;
+	} else if (sscanf(spec, "LAYER%02d.LAY", subindex) == 1) {
+		*index = 9;
+		if (strlen(spec) > 31) {
+			fprintf(stderr, "%s: filename %s too long\n", __func__, spec);
+			return -1;
+		}
+		strcpy(input, spec);
+	} else if (sscanf(spec, "%d,%d,%31s%n", index, subindex, input, &pos) != 3) {
+		fprintf(stderr, "%s: invalid spec: %s\n", __func__, spec);
+		return -1;
+	}
+
+	/* %31s stops early on a longer name */
+	if (pos && spec[pos]) {
+		fprintf(stderr, "%s: filename in %s too long\n", __func__, spec);
+		return -1;
+	}
+	return 0;
+}
+
+/* send request and data of an upload, the reply is left to the caller */
+static int start_write(int cmd, int index, int subindex, const char *input)
+{
+	struct stat statbuf;
+	int infd, ret = -1;
+
+	infd = open(input, O_RDONLY);
+	if (infd == -1) {
+		fprintf(stderr, "%s: failed to open %s: %m\n", __func__, input);
+		return -1;
+	}
+
+	if (fstat(infd, &statbuf) == -1) {
+		fprintf(stderr, "fstat: %m\n");
+		goto out;
+	}
+
+	io_budget(statbuf.st_size);
+	if (write_request(cmd, index, subindex, input, statbuf.st_size) == -1) {
+		fprintf(stderr, "%s: failed to write request: %m\n", __func__);
+		goto out;
+	}
+
+	/* the keyboard waits for the rest of the data now */
+	if (send_file(infd, statbuf.st_size) == -1)
+		goto out;
+	ret = 0;
+out:
+	close(infd);
+	return ret;
+}
+
+static int writefile(char *spec)
+{
+	int cmd, index, subindex;
+	char input[32];
+
+	if (parse_writespec(spec, &cmd, &index, &subindex, input) == -1)
+		return -1;
+
+	if (start_write(cmd, index, subindex, input) == -1)
+		return -1;
+	return write_reply(cmd, input);
+}
+
+/*
+ * Find out whether the keyboard takes a request while it is still busy
+ * with the previous one: ask for the listing twice in a row and check
+ * that both answers arrive intact.
+ */
+static int probe_pipelining(void)
+{
+	struct cmd_listfiles request[2] = { { .cmd = HP_CMD_LISTFILES }, { .cmd = HP_CMD_LISTFILES } };
+	int count[2] = { -1, -1 }, ok;
+	uint32_t hash[2] = { 2166136261u, 2166136261u };
+	struct fileentry entry;
+
+	io_failed = 0;
+	io_deadline = now_ms() + io_timeout;
+	if (write_keyboard(request, sizeof(request)) == -1) {
+		fprintf(stderr, "%s: send request: %m\n", __func__);
+		return -1;
+	}
+
+	/* compare FNV-1a hashes, the listings can be long */
+	for (int l = 0; l < 2; l++) {
+		count[l] = recv_listing_header();
+		for (int i = 0; i < count[l] && count[l] != -1; i++) {
+			if (recv_entry(&entry) == -1) {
+				count[l] = -1;
+				break;
+			}
+			for (size_t b = 0; b < sizeof(entry); b++)
+				hash[l] = (hash[l] ^ ((uint8_t *)&entry)[b]) * 16777619u;
+		}
+		if (count[l] == -1)
+			break;
+	}
+
+	ok = count[0] > 0 && count[0] == count[1] && hash[0] == hash[1];
+
+	io_deadline = 0;
+	if (!ok) {
+		fprintf(stderr, "%s: no pipelining, sending one request at a time\n", __func__);
+		if (resync() == -1)
+			return -1;
+	}
+	return ok;
+}
+
+/* result of probe_pipelining(), cached like the config only with --id */
+static int pipelining(void)
+{
+	char path[PATH_MAX], buf[4];
+	int fd, ret;
+
+	if (!kbd_named || cache_path(path, sizeof(path), "pipeline") == -1)
+		return probe_pipelining();
+
+	fd = open(path, O_RDONLY);
+	if (fd != -1) {
+		ret = read(fd, buf, sizeof(buf));
+		close(fd);
+		if (ret > 0)
+			return buf[0] == '1';
+	}
+
+	ret = probe_pipelining();
+	if (ret == -1)
+		return -1;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd != -1) {
+		dprintf(fd, "%d\n", ret);
+		close(fd);
+	}
+	return ret;
+}
+
+static int parse_fileop(int cmd, char *spec, struct fileop *op)
+{
+	memset(op, 0, sizeof(*op));
+	op->cmd = cmd;
+	op->spec = spec;
+
+	if (cmd == HP_CMD_WRITEFILE)
+		return parse_writespec(spec, &op->cmd, &op->index, &op->subindex, op->input);
+
+	if (sscanf(spec, "%d,%d", &op->index, &op->subindex) != 2) {
+		fprintf(stderr, "%s: invalid spec: %s\n", __func__, spec);
+		return -1;
+	}
+	return 0;
+}
+
+/* graphics replies do not carry the index, those run on their own */
+static int fileop_barrier(struct fileop *op)
+{
+	return op->cmd == HP_CMD_WRITEGRAPH ||
+		(op->cmd == HP_CMD_READFILE && (op->index == 4 || op->index == 6));
+}
+
+static int fileop_send(struct fileop *op)
+{
+	switch (op->cmd) {
+	case HP_CMD_READFILE:
+		return send_read(op->index, op->subindex);
+	case HP_CMD_DELETE:
+		return send_delete(op->index, op->subindex);
+	default:
+		return start_write(op->cmd, op->index, op->subindex, op->input);
+	}
+}
+
+/*
+ * Replies echo command, index and subindex. One request at a time only
+ * the command is checked, like the single operations do.
+ */
+static int fileop_match(struct fileop *op, struct reply_fileop *reply, int strict)
+{
+	return reply->cmd == op->cmd && (!strict ||
+		(ntohs(reply->index) == op->index && ntohs(reply->subindex) == op->subindex));
+}
+
+/* receive the reply for ops[done], the oldest request in flight */
+static int fileop_recv(struct fileop *ops, int done, int sent, int strict)
+{
+	struct fileop *op = &ops[done];
+	struct reply_fileop reply;
+	uint32_t size;
+	char name[32];
+	int i;
+
+	if (op->failed)
+		return -1;
+
+	if (read_keyboard(&reply, sizeof(reply)) == -1) {
+		fprintf(stderr, "%s: %s: receive header: %m\n", __func__, op->spec);
+		return -1;
+	}
+
+	for (i = done; i < sent && !fileop_match(&ops[i], &reply, strict); i++)
+		;
+	if (i != done) {
+		fprintf(stderr, "%s: %s: got reply %02x for %d,%d\n", __func__, op->spec,
+			reply.cmd, ntohs(reply.index), ntohs(reply.subindex));
+		io_failed = 1;
+		return -1;
+	}
+
+	if (op->cmd == HP_CMD_READFILE) {
+		if (read_header(&reply, name, &size) == -1)
+			return -1;
+		return receive_file(op->index, op->subindex, name, size);
+	}
+
+	if (ntohs(reply.status) != 0xd000) {
+		fprintf(stderr, "%s: %s: failed: %04x\n", __func__, op->spec, ntohs(reply.status));
+		/* deletes go out alone, nothing else is in flight */
+		if (op->cmd == HP_CMD_DELETE && op->missing_ok &&
+		    file_exists(op->index, op->subindex) == 0) {
+			fprintf(stderr, "%s: not on the keyboard, nothing to delete\n", op->spec);
+			return 0;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Only reads are sent ahead. probe_pipelining() tests back to back
+ * listings, which like reads change nothing on the keyboard, so a wrong
+ * guess costs a retry. Deletes and writes always go out alone.
+ */
+static int fileop_pipelined(struct fileop *op)
+{
+	return op->cmd == HP_CMD_READFILE;
+}
+
+/*
+ * Run reads, deletes and writes in order. Where the keyboard allows it
+ * up to PIPE_WINDOW reads are sent ahead, so the next one is queued
+ * while the previous reply still streams in. After a transport failure
+ * everything in flight is sent again, one request at a time. A delete
+ * the keyboard may already have carried out is only sent again if the
+ * file is still listed.
+ */
+static int run_fileops(struct fileop *ops, int nops)
+{
+	int window = 1, sent = 0, done = 0, ret = 0, err = 0, pipe = 0;
+
+	/* the probe costs two listings, only worth it for reads in a row */
+	for (int i = 1; i < nops; i++)
+		if (fileop_pipelined(&ops[i - 1]) && fileop_pipelined(&ops[i]) &&
+		    !fileop_barrier(&ops[i - 1]) && !fileop_barrier(&ops[i]))
+			pipe = 1;
+
+	if (pipe) {
+		err = pipelining();
+		if (err == -1)
+			return -1;
+		if (err)
+			window = PIPE_WINDOW;
+	}
+
+	while (done < nops) {
+		struct fileop *op = &ops[done];
+
+		if (fileop_barrier(op)) {
+			err = retry(op->cmd == HP_CMD_READFILE ? readfile : writefile, op->spec,
+				    op->cmd == HP_CMD_READFILE ? "read" : "write");
+			if (err == -1)
+				ret = -1;
+			sent = ++done;
+			continue;
+		}
+
+		io_failed = 0;
+		io_deadline = now_ms() + io_timeout;
+		while (!io_failed && sent < nops && sent - done < window && !fileop_barrier(&ops[sent]) &&
+		       (sent == done || (fileop_pipelined(&ops[sent]) && fileop_pipelined(&ops[sent - 1])))) {
+			/* nothing went out if a local file failed */
+			if (fileop_send(&ops[sent]) == -1 && !io_failed)
+				ops[sent].failed = 1;
+			sent++;
+		}
+
+		if (!io_failed) {
+			io_deadline = now_ms() + io_timeout;
+			err = fileop_recv(ops, done, sent, window > 1);
+		}
+
+		if (!io_failed) {
+			if (err == -1)
+				ret = -1;
+			done++;
+			continue;
+		}
+
+		io_deadline = 0;
+		if (++op->tries > IO_RETRIES) {
+			fprintf(stderr, "%s: giving up\n", op->spec);
+			return -1;
+		}
+		fprintf(stderr, "%s: transport failed, retry %d of %d\n", op->spec, op->tries, IO_RETRIES);
+		if (resync() == -1)
+			return -1;
+
+		for (int i = done; i < sent; i++)
+			ops[i].failed = 0;
+		window = 1;
+
+		if (op->cmd == HP_CMD_DELETE && sent > done) {
+			io_failed = 0;
+			io_deadline = now_ms() + io_timeout;
+			err = file_exists(op->index, op->subindex);
+			io_deadline = 0;
+			if (err == -1) {
+				fprintf(stderr, "%s: can't tell whether it was deleted, giving up\n", op->spec);
+				return -1;
+			}
+			if (!err) {
+				fprintf(stderr, "%s: already deleted\n", op->spec);
+				done++;
+			}
+		}
+		sent = done;
+	}
+
+	io_deadline = 0;
+	return ret;
+}
+
+static int reboot_kbd(void)
+{
+	uint8_t cmd[] = { 0x7f, 0xe4, 0x31, 0xc0, 0x02 };
+
+	if (write_keyboard(cmd, sizeof(cmd)) == 1) {
+		fprintf(stderr, "%s: %m\n", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+static int rawtx(uint8_t *buf, int size)
+{
+	return write_keyboard(buf, size);
+}
+
+static int rawrx(int size)
+{
+	uint8_t buf[512];
+	int ret;
+
+	if (size > 1048576) {
+		fprintf(stderr, "%s: size exceeds limit of 1MB\n", __func__);
+		return -1;
+	}
+
+	/* read_keyboard() dumps every chunk */
+	while (size > 0) {
+		ret = read_keyboard(buf, MIN(size, (int)sizeof(buf)));
+		if (ret == -1)
+			return -1;
+		size -= ret;
+	}
+	return 0;
+}
+
+/* send what display_diff() collected so far */
+static int display_send(uint8_t *out, size_t *len)
+{
+	if (*len && write_keyboard(out, *len) == -1)
+		return -1;
+	*len = 0;
+	return 0;
+}
+
+/*
+ * Send the commands needed to turn what the keyboard currently shows
+ * into the next frame. Runs of changed cells on a row are merged when
+ * the gap between them is shorter than a gotoxy sequence. The commands
+ * are collected in out and sent whenever it is full.
+ */
+static int display_diff(struct display *shown, struct display *next, uint8_t *out, size_t size)
+{
+	size_t len = 0;
+	int attr = -1;
+
+	for (int y = 0; y < LCD_ROWS; y++) {
+		int x = 0;
+
+		while (x < LCD_COLS) {
+			int start, end, gap;
+
+			if (shown->valid && shown->text[y][x] == next->text[y][x] &&
+			    shown->attr[y][x] == next->attr[y][x]) {
+				x++;
+				continue;
+			}
+
+			start = x;
+			end = x + 1;
+			for (gap = 0; end + gap < LCD_COLS && gap < LCD_GAP; ) {
+				int i = end + gap;
+
+				if (next->attr[y][i] != next->attr[y][start])
+					break;
+				if (shown->valid && shown->text[y][i] == next->text[y][i] &&
+				    shown->attr[y][i] == next->attr[y][i]) {
+					gap++;
+					continue;
+				}
+				end = i + 1;
+				gap = 0;
+			}
+
+			/* gotoxy 5, attr 4, print header 3, text, NUL */
+			if (len + 13 + (end - start) > size && display_send(out, &len) == -1)
+				return -1;
+
+			out[len++] = HP_CMD_EXT;
+			out[len++] = HP_EXT_GOTOXY;
+			out[len++] = 0;
+			out[len++] = y;
+			out[len++] = start;
+
+			if (attr != next->attr[y][start]) {
+				attr = next->attr[y][start];
+				out[len++] = HP_CMD_EXT;
+				out[len++] = HP_EXT_ATTR;
+				out[len++] = 0;
+				out[len++] = attr;
+			}
+
+			out[len++] = HP_CMD_EXT;
+			out[len++] = HP_EXT_PRINT;
+			out[len++] = 0;
+			memcpy(out + len, &next->text[y][start], end - start);
+			len += end - start;
+			out[len++] = '\0';
+			x = end;
+		}
+	}
+
+	for (int i = 0; i < LCD_LEDS; i++) {
+		if (shown->valid && shown->led[i] == next->led[i])
+			continue;
+		if (len + 4 > size && display_send(out, &len) == -1)
+			return -1;
+		out[len++] = HP_CMD_EXT;
+		out[len++] = HP_EXT_LED;
+		out[len++] = i;
+		out[len++] = next->led[i];
+	}
+
+	if (next->brightness != -1 &&
+	    (!shown->valid || shown->brightness != next->brightness)) {
+		if (len + 2 > size && display_send(out, &len) == -1)
+			return -1;
+		out[len++] = HP_CMD_BRIGHTNESS;
+		out[len++] = next->brightness;
+	}
+	return display_send(out, &len);
+}
+
+static int display_flush(struct display *shown, struct display *next)
+{
+	/*
+	 * Worst case every cell starts a run: gotoxy, attr, print header,
+	 * NUL. That fits into the default XFER_CHUNK, so a frame goes out in
+	 * one write; with the embedded chunk size it is split.
+	 */
+	static uint8_t buf[MIN(XFER_CHUNK, LCD_ROWS * LCD_COLS * 13 + LCD_LEDS * 4 + 2)];
+
+	if (display_diff(shown, next, buf, sizeof(buf)) == -1) {
+		fprintf(stderr, "%s: %m\n", __func__);
+		shown->valid = 0;
+		return -1;
+	}
+
+	*shown = *next;
+	shown->valid = 1;
+	return 0;
+}
+
+/*
+ * Read frames from stdin, one command per line:
+ *
+ *   text ROW COL STRING   put STRING at ROW/COL
+ *   attr MASK             attribute for following text, 0x01 inverted, 0x10 large
+ *   led N STATE           0 off, 1 green, 2 red
+ *   brightness N          LCD brightness 0..255
+ *   clear                 blank the whole screen
+ *
+ * An empty line sends the difference to the previous frame.
+ */
+static int display(void)
+{
+	struct display shown = { .valid = 0 }, next = { .brightness = -1 };
+	char line[256], str[LCD_COLS + 1];
+	unsigned int a, b;
+	int attr = 0;
+
+	memset(next.text, ' ', sizeof(next.text));
+
+	while (fgets(line, sizeof(line), stdin)) {
+		int pos = 0;
+
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if (!line[0]) {
+			if (display_flush(&shown, &next) == -1)
+				return -1;
+		} else if (sscanf(line, "text %u %u %n", &a, &b, &pos) == 2 && pos) {
+			if (a >= LCD_ROWS || b >= LCD_COLS)
+				goto invalid;
+			snprintf(str, sizeof(str), "%s", line + pos);
+			for (size_t i = 0; str[i] && b + i < LCD_COLS; i++) {
+				next.text[a][b + i] = str[i];
+				next.attr[a][b + i] = attr;
+			}
+		} else if (sscanf(line, "attr %i", &attr) == 1) {
+		} else if (sscanf(line, "led %u %u", &a, &b) == 2) {
+			if (a >= LCD_LEDS)
+				goto invalid;
+			next.led[a] = b;
+		} else if (sscanf(line, "brightness %u", &a) == 1) {
+			next.brightness = MIN(a, 255);
+		} else if (!strcmp(line, "clear")) {
+			memset(next.text, ' ', sizeof(next.text));
+			memset(next.attr, 0, sizeof(next.attr));
+		} else {
+			goto invalid;
+		}
+		continue;
+invalid:
+		fprintf(stderr, "%s: invalid command: %s\n", __func__, line);
+	}
+	return display_flush(&shown, &next);
+}
+
+/*
+ * Control channel: switch workstation, layer and page with as little
+ * delay as possible. Frames are a few fixed bytes and go out as one
+ * write, bypassing the file protocol.
+ */
+static long ctl_send(uint8_t *frame, size_t len)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (write_keyboard(frame, len) != (int)len)
+		return -1;
+
+	/* the frame is with the keyboard once it left the UART */
+	if (kbfd != -1 && tcdrain(kbfd) == -1) {
+		fprintf(stderr, "%s: tcdrain: %m\n", __func__);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+static long ctl_attach(int ws)
+{
+	uint8_t frame[] = { HP_CMD_EXT, HP_EXT_ATTACH, ws };
+
+	return ctl_send(frame, sizeof(frame));
+}
+
+static long ctl_switch(int layer, int page)
+{
+	uint8_t frame[] = { HP_CMD_EXT, HP_EXT_SWITCH, layer, page };
+
+	return ctl_send(frame, sizeof(frame));
+}
+
+static long ctl_layer(int layer)
+{
+	uint8_t frame[] = { HP_CMD_LAYER, layer };
+
+	return ctl_send(frame, sizeof(frame));
+}
+
+static long ctl_page(int page)
+{
+	uint8_t frame[] = { HP_CMD_PAGE, page };
+
+	return ctl_send(frame, sizeof(frame));
+}
+
+/* run one command line, the reply is "ok <us>" or "error <reason>" */
+static void ctl_command(char *line, char *reply, size_t size, struct ctl_stats *stats)
+{
+	unsigned int a, b;
+	long us;
+
+	line[strcspn(line, "\r\n")] = '\0';
+
+	if (sscanf(line, "ws %i", &a) == 1 && a <= 0xff)
+		us = ctl_attach(a);
+	else if (!strcmp(line, "detach"))
+		us = ctl_attach(CTL_DETACH);
+	else if (sscanf(line, "switch %i %i", &a, &b) == 2 && a <= 0xff && b <= 0xff)
+		us = ctl_switch(a, b);
+	else if (sscanf(line, "layer %i", &a) == 1 && a <= 0xff)
+		us = ctl_layer(a);
+	else if (sscanf(line, "page %i", &a) == 1 && a <= 0xff)
+		us = ctl_page(a);
+	else {
+		snprintf(reply, size, "error invalid command\n");
+		return;
+	}
+
+	if (us == -1) {
+		snprintf(reply, size, "error %s\n", strerror(errno));
+		return;
+	}
+
+	if (!stats->count || us < stats->min_us)
+		stats->min_us = us;
+	stats->max_us = MAX(stats->max_us, us);
+	stats->total_us += us;
+	stats->count++;
+	snprintf(reply, size, "ok %ld\n", us);
+}
+
+/* returns -1 when the client is gone */
+static int ctl_read(struct ctl_client *c, struct ctl_stats *stats)
+{
+	char reply[64], *nl;
+	ssize_t ret;
+
+	ret = read(c->in, c->line + c->len, sizeof(c->line) - 1 - c->len);
+	if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (ret <= 0)
+		return -1;
+	c->len += ret;
+	c->line[c->len] = '\0';
+
+	while ((nl = strchr(c->line, '\n'))) {
+		*nl = '\0';
+		ctl_command(c->line, reply, sizeof(reply), stats);
+		if (write(c->out, reply, strlen(reply)) == -1)
+			return -1;
+		c->len -= nl + 1 - c->line;
+		memmove(c->line, nl + 1, c->len + 1);
+	}
+
+	if (c->len == sizeof(c->line) - 1) {
+		fprintf(stderr, "%s: line too long, dropped\n", __func__);
+		c->len = 0;
+	}
+	return 0;
+}
+
+/*
+ * Serve switch commands from stdin ("-") or clients of a unix socket
+ * until EOF or a signal, keeping the keyboard open all the time.
+ */
+static int control(const char *path)
+{
+	struct ctl_client clients[CTL_MAX_CLIENTS];
+	struct pollfd pfd[CTL_MAX_CLIENTS + 2];
+	struct ctl_stats stats = { 0 };
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct serial_struct serial;
+	struct stat statbuf;
+	int nclients = 0, lfd = -1, bound = 0, ret = -1;
+	uint8_t discard[64];
+
+	signal(SIGINT, stop_handler);
+	signal(SIGTERM, stop_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* don't let the USB serial adapter hold back small frames */
+	if (kbfd != -1 && ioctl(kbfd, TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		ioctl(kbfd, TIOCSSERIAL, &serial);
+	}
+
+	if (!strcmp(path, "-")) {
+		clients[nclients++] = (struct ctl_client){ .in = STDIN_FILENO, .out = STDOUT_FILENO };
+	} else {
+		if (strlen(path) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "%s: socket path too long: %s\n", __func__, path);
+			return -1;
+		}
+		strcpy(addr.sun_path, path);
+
+		lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (lfd == -1) {
+			fprintf(stderr, "%s: socket: %m\n", __func__);
+			return -1;
+		}
+		/* only replace a stale socket, never anything else */
+		if (lstat(path, &statbuf) == 0) {
+			if (!S_ISSOCK(statbuf.st_mode)) {
+				fprintf(stderr, "%s: %s exists and is not a socket\n", __func__, path);
+				goto out;
+			}
+			unlink(path);
+		}
+		if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+			fprintf(stderr, "%s: %s: %m\n", __func__, path);
+			goto out;
+		}
+		bound = 1;
+		if (listen(lfd, 4) == -1) {
+			fprintf(stderr, "%s: %s: %m\n", __func__, path);
+			goto out;
+		}
+	}
+
+	while (!stop && (lfd != -1 || nclients)) {
+		int n = 0, lidx = -1;
+
+		for (int i = 0; i < nclients; i++)
+			pfd[n++] = (struct pollfd){ .fd = clients[i].in, .events = POLLIN };
+		if (lfd != -1) {
+			lidx = n;
+			pfd[n++] = (struct pollfd){ .fd = lfd, .events = nclients < CTL_MAX_CLIENTS ? POLLIN : 0 };
+		}
+		/* whatever the keyboard sends on its own is of no interest here */
+		if (kbfd != -1)
+			pfd[n++] = (struct pollfd){ .fd = kbfd, .events = POLLIN };
+
+		if (poll(pfd, n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll: %m\n", __func__);
+			goto out;
+		}
+
+		if (kbfd != -1 && pfd[n - 1].revents & POLLIN &&
+		    read_keyboard_timeout(discard, sizeof(discard), 0, 0) == -1)
+			goto out;
+
+		/* pfd[i] belongs to clients[i], new clients are added afterwards */
+		for (int i = nclients - 1; i >= 0; i--) {
+			if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			if (ctl_read(&clients[i], &stats) == 0)
+				continue;
+			if (clients[i].in != STDIN_FILENO)
+				close(clients[i].in);
+			clients[i] = clients[--nclients];
+		}
+
+		if (lidx != -1 && pfd[lidx].revents & POLLIN && nclients < CTL_MAX_CLIENTS) {
+			int fd = accept(lfd, NULL, NULL);
+
+			/* a client that stops reading must not block the others */
+			if (fd != -1 && fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+				close(fd);
+				fd = -1;
+			}
+			if (fd != -1)
+				clients[nclients++] = (struct ctl_client){ .in = fd, .out = fd };
+		}
+	}
+	ret = 0;
+out:
+	for (int i = 0; i < nclients; i++)
+		if (clients[i].in != STDIN_FILENO)
+			close(clients[i].in);
+	if (lfd != -1)
+		close(lfd);
+	if (bound)
+		unlink(path);
+	if (stats.count)
+		fprintf(stderr, "%ld switches, latency min %ldus avg %ldus max %ldus\n", stats.count,
+			stats.min_us, stats.total_us / stats.count, stats.max_us);
+	return ret;
+}
+
+static int parse_scanspec(char *arg, struct scanspec *spec)
+{
+	char *p, *endp;
+
+	spec->len = 0;
+	while ((p = strtok(arg, ";,"))) {
+		if (spec->len == SCAN_MAXLEN) {
+			fprintf(stderr, "%s: more than %d bytes in `%s'\n", __func__, SCAN_MAXLEN, p);
+			return -1;
+		}
+
+		spec->lo[spec->len] = spec->hi[spec->len] = strtoul(p, &endp, 16);
+		if (*endp == '-')
+			spec->hi[spec->len] = strtoul(endp + 1, &endp, 16);
+		if (*endp || spec->hi[spec->len] < spec->lo[spec->len]) {
+			fprintf(stderr, "%s: failed to parse `%s'\n", __func__, p);
+			return -1;
+		}
+		spec->len++;
+		arg = NULL;
+	}
+	return spec->len ? 0 : -1;
+}
+
+static int scan_denied(uint8_t *cmd, int len)
+{
+	for (size_t i = 0; i < sizeof(scan_denylist) / sizeof(scan_denylist[0]); i++) {
+		if (len >= scan_denylist[i].len &&
+		    !memcmp(cmd, scan_denylist[i].prefix, scan_denylist[i].len))
+			return 1;
+	}
+	return 0;
+}
+
+/* full length of a probe with arguments, 0 when the arguments are unknown */
+static int scan_cmdlen(uint8_t *cmd, int len)
+{
+	for (size_t i = 0; i < sizeof(scan_args) / sizeof(scan_args[0]); i++) {
+		if (len >= scan_args[i].len &&
+		    !memcmp(cmd, scan_args[i].prefix, scan_args[i].len))
+			return MAX(len, scan_args[i].len + scan_args[i].args);
+	}
+	return 0;
+}
+
+/*
+ * One tab separated line per probe:
+ * device, command, status (reply/slow/none), latency in ms, reply bytes
+ */
+static void scan_record(int dbfd, const char *name, struct scanresult *res, const char *status)
+{
+	char line[4096];
+	int len;
+
+	len = snprintf(line, sizeof(line), "%s\t", name);
+	for (int i = 0; i < res->cmdlen; i++)
+		len += snprintf(line + len, sizeof(line) - len, "%02x", res->cmd[i]);
+	len += snprintf(line + len, sizeof(line) - len, "\t%s\t%ld\t", status, res->latency);
+	for (int i = 0; i < res->replylen && len < (int)sizeof(line) - 4; i++)
+		len += snprintf(line + len, sizeof(line) - len, "%02x", res->reply[i]);
+	line[len++] = '\n';
+
+	/* one write per line, O_APPEND keeps lines of parallel workers intact */
+	if (write(dbfd, line, len) != len)
+		fprintf(stderr, "%s: %m\n", __func__);
+}
+
+/*
+ * After a command with unknown arguments, feed it zeros and check that
+ * the keyboard answers the ID query again before the next probe goes
+ * out. Without an answer the scan stops, anything sent afterwards
+ * could end up as arguments of the unknown command.
+ */
+static int scan_sync(int dbfd, const char *name, struct scanresult *res, int timeout)
+{
+	uint8_t sync[SCAN_PAD + 2] = { [SCAN_PAD] = 0x7f, [SCAN_PAD + 1] = 0xe8 };
+	int ret;
+
+	for (int tries = 0; tries < SCAN_SYNC_TRIES; tries++) {
+		if (write_keyboard(sync, sizeof(sync)) == -1)
+			return -1;
+
+		for (;;) {
+			ret = read_keyboard_timeout(res->reply, sizeof(res->reply), timeout, SCAN_GAP);
+			if (ret <= 0)
+				break;
+			if (ret >= 2 && res->reply[0] == 0x7f && res->reply[1] == 0xe8)
+				return 0;
+			res->replylen = ret;
+			scan_record(dbfd, name, res, "stray");
+		}
+		if (ret == -1)
+			return -1;
+	}
+
+	fprintf(stderr, "%s: no reply to the ID query after ", name);
+	for (int i = 0; i < res->cmdlen; i++)
+		fprintf(stderr, "%02x", res->cmd[i]);
+	fprintf(stderr, ", stopping\n");
+	return -1;
+}
+
+/*
+ * Sweep every n-th command of the given specs, starting at worker. The
+ * reply timeout follows the observed latency. A reply that only shows
+ * up within a second timeout period is recorded as slow. Replies echo
+ * the command byte, so anything arriving even later is told apart and
+ * logged as stray data instead of being taken for the current reply.
+ * Known commands are padded to their argument length, after all others
+ * the keyboard has to answer an ID query before the scan goes on.
+ */
+static int scan(struct scanspec *specs, int nspecs, int worker, int nworkers, int dbfd,
+		const char *name)
+{
+	struct scanresult res = { .cmdlen = 0 };
+	long avg = -1, start = 0, count = 0, idx = 0;
+	int timeout = SCAN_TIMEOUT, ret, tries, len;
+	const char *status;
+
+	for (int s = 0; s < nspecs; s++) {
+		struct scanspec *spec = &specs[s];
+		uint8_t cmd[SCAN_MAXLEN];
+		int pos;
+
+		memcpy(cmd, spec->lo, spec->len);
+		do {
+			if (idx++ % nworkers != worker || scan_denied(cmd, spec->len))
+				goto next;
+
+			ret = read_keyboard_timeout(res.reply, sizeof(res.reply), 0, SCAN_GAP);
+			if (ret == -1)
+				return -1;
+			if (ret) {
+				res.replylen = ret;
+				res.latency = now_ms() - start;
+				scan_record(dbfd, name, &res, "stray");
+			}
+
+			len = scan_cmdlen(cmd, spec->len);
+			memset(res.cmd, 0, sizeof(res.cmd));
+			memcpy(res.cmd, cmd, spec->len);
+			res.cmdlen = len ? len : spec->len;
+			start = now_ms();
+			if (write_keyboard(res.cmd, res.cmdlen) == -1)
+				return -1;
+
+			status = "reply";
+			for (tries = 0; tries < 4; tries++) {
+				ret = read_keyboard_timeout(res.reply, sizeof(res.reply), timeout, SCAN_GAP);
+				if (ret <= 0 || res.reply[0] == cmd[0])
+					break;
+				res.replylen = ret;
+				res.latency = now_ms() - start;
+				scan_record(dbfd, name, &res, "stray");
+				timeout = MIN(SCAN_MAX_TIMEOUT, timeout * 2);
+			}
+			if (!ret) {
+				status = "slow";
+				ret = read_keyboard_timeout(res.reply, sizeof(res.reply), timeout, SCAN_GAP);
+			}
+			if (ret == -1)
+				return -1;
+
+			res.latency = now_ms() - start;
+			res.replylen = ret;
+			if (!ret) {
+				status = "none";
+			} else if (!strcmp(status, "slow")) {
+				timeout = MIN(SCAN_MAX_TIMEOUT, timeout * 2);
+			} else {
+				avg = avg == -1 ? res.latency : (avg * 7 + res.latency) / 8;
+				timeout = MIN(SCAN_MAX_TIMEOUT, MAX(SCAN_MIN_TIMEOUT, 3 * avg));
+			}
+			scan_record(dbfd, name, &res, status);
+
+			if (!len && scan_sync(dbfd, name, &res, timeout) == -1)
+				return -1;
+
+			if (!(++count % 256))
+				fprintf(stderr, "%s: %ld commands probed, timeout %d ms\n", name, count, timeout);
+next:
+			/* advance like an odometer, last byte fastest */
+			for (pos = spec->len - 1; pos >= 0; pos--) {
+				if (cmd[pos] < spec->hi[pos]) {
+					cmd[pos]++;
+					break;
+				}
+				cmd[pos] = spec->lo[pos];
+			}
+		} while (pos >= 0);
+	}
+	return 0;
+}
+
+#ifdef WITH_FUSE
+/*
+ * Keyboard storage as filesystem: one directory per index, files named
+ * <subindex>-<name>. Contents are fetched on first access and kept in
+ * memory, changes are sent as one upload on close() or fsync(), which
+ * return the result of the upload.
+ */
+struct fs_file {
+	int index;
+	int subindex;
+	char name[32];
+	uint8_t *data;
+	size_t size;
+	size_t alloc;
+	int loaded;
+	int dirty;
+	int used;
+};
+
+static struct fs_file fs_files[FS_MAX_FILES];
+static int fs_listed;
+
+static struct fs_file *fs_add(int index, int subindex, const char *name)
+{
+	for (int i = 0; i < FS_MAX_FILES; i++) {
+		struct fs_file *f = &fs_files[i];
+
+		if (f->used)
+			continue;
+		memset(f, 0, sizeof(*f));
+		f->used = 1;
+		f->index = index;
+		f->subindex = subindex;
+		snprintf(f->name, sizeof(f->name), "%s", name);
+		return f;
+	}
+	return NULL;
+}
+
+static int fs_fetch_list(char *unused)
+{
+	struct fileentry *entries;
+	int count;
+
+	(void)unused;
+	count = get_listing(&entries);
+	if (count == -1)
+		return -1;
+
+	for (int i = 0; i < count; i++)
+		fs_add(ntohs(entries[i].index), ntohs(entries[i].subindex), entries[i].name);
+	free(entries);
+	return 0;
+}
+
+static int fs_list(void)
+{
+	if (fs_listed)
+		return 0;
+
+	if (retry(fs_fetch_list, NULL, "list") == -1)
+		return -EIO;
+	fs_listed = 1;
+	return 0;
+}
+
+static struct fs_file *fs_lookup(const char *path)
+{
+	int index, subindex, pos = 0;
+
+	if (fs_list() < 0)
+		return NULL;
+
+	if (sscanf(path, "/%d/%d-%n", &index, &subindex, &pos) != 2 || !pos)
+		return NULL;
+
+	for (int i = 0; i < FS_MAX_FILES; i++) {
+		struct fs_file *f = &fs_files[i];
+
+		if (f->used && f->index == index && f->subindex == subindex &&
+		    !strcmp(f->name, path + pos))
+			return f;
+	}
+	return NULL;
+}
+
+static int fs_reserve(struct fs_file *f, size_t size)
+{
+	uint8_t *data;
+
+	if (size <= f->alloc)
+		return 0;
+
+	size = MAX(size, f->alloc * 2);
+	data = realloc(f->data, size);
+	if (!data)
+		return -ENOMEM;
+	f->data = data;
+	f->alloc = size;
+	return 0;
+}
+
+static int fs_load(struct fs_file *f)
+{
+	char name[32];
+	uint32_t size;
+
+	if (f->loaded)
+		return 0;
+
+	if (request_file(f->index, f->subindex, name, &size) == -1)
+		return -EIO;
+	io_budget(size);
+
+	if (fs_reserve(f, size) < 0) {
+		uint8_t buf[512];
+
+		/* the data is on its way, keep the stream in sync */
+		while (size > 0) {
+			if (read_keyboard(buf, MIN(size, sizeof(buf))) == -1)
+				break;
+			size -= MIN(size, sizeof(buf));
+		}
+		return -ENOMEM;
+	}
+
+	if (size && read_keyboard(f->data, size) == -1)
+		return -EIO;
+	f->size = size;
+	f->loaded = 1;
+	return 0;
+}
+
+static int fs_store(struct fs_file *f)
+{
+	size_t done = 0;
+	int ret;
+
+	if (!f->dirty)
+		return 0;
+
+	io_budget(f->size);
+	if (write_request(HP_CMD_WRITEFILE, f->index, f->subindex, f->name, f->size) == -1)
+		return -EIO;
+
+	/* from here on resync() has to pad what is missing */
+	io_owed = f->size;
+	while (done < f->size) {
+		ret = write_keyboard(f->data + done, MIN(f->size - done, XFER_CHUNK));
+		if (ret == -1)
+			return -EIO;
+		done += ret;
+		io_owed = f->size - done;
+	}
+
+	if (write_reply(HP_CMD_WRITEFILE, f->name) == -1)
+		return -EIO;
+	f->dirty = 0;
+
+	/* the upload replaced whatever else was stored in this slot */
+	for (int i = 0; i < FS_MAX_FILES; i++) {
+		struct fs_file *g = &fs_files[i];
+
+		if (g != f && g->used && g->index == f->index && g->subindex == f->subindex) {
+			free(g->data);
+			g->used = 0;
+		}
+	}
+	return 0;
+}
+
+/* a delete whose reply got lost may have been carried out already */
+static int fs_remove(struct fs_file *f)
+{
+	int ret;
+
+	if (delete_file(f->index, f->subindex) == 0)
+		return 0;
+	if (io_failed)
+		return -EIO;
+
+	ret = file_exists(f->index, f->subindex);
+	if (ret == -1)
+		return -EIO;
+	return ret ? -EIO : 0;
+}
+
+/* retry() for the transfers of one file, errors are returned as -errno */
+static int fs_retry(int (*op)(struct fs_file *), struct fs_file *f)
+{
+	int ret;
+
+	for (int attempt = 1; ; attempt++) {
+		io_failed = 0;
+		io_deadline = now_ms() + io_timeout;
+		ret = op(f);
+		io_deadline = 0;
+		if (ret >= 0 || !io_failed || attempt > IO_RETRIES)
+			return ret;
+
+		fprintf(stderr, "%d/%d-%s: transport failed, retry %d of %d\n", f->index,
+			f->subindex, f->name, attempt, IO_RETRIES);
+		if (resync() == -1)
+			return -EIO;
+	}
+}
+
+static int fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	struct fs_file *f;
+	int index, pos = 0;
+
+	(void)fi;
+	memset(st, 0, sizeof(*st));
+
+	if (!strcmp(path, "/") || (sscanf(path, "/%d%n", &index, &pos) == 1 && !path[pos])) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return 0;
+	}
+
+	f = fs_lookup(path);
+	if (!f)
+		return -ENOENT;
+
+	/* unknown until read, reads use direct_io and are not limited by it */
+	st->st_mode = S_IFREG | 0644;
+	st->st_nlink = 1;
+	st->st_size = f->loaded ? f->size : 0;
+	return 0;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t fill, off_t offset,
+		      struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	char name[64];
+	int index, pos = 0, ret;
+
+	(void)offset;
+	(void)fi;
+	(void)flags;
+
+	ret = fs_list();
+	if (ret < 0)
+		return ret;
+
+	fill(buf, ".", NULL, 0, 0);
+	fill(buf, "..", NULL, 0, 0);
+
+	if (!strcmp(path, "/")) {
+		for (int i = 0; i < FS_MAX_FILES; i++) {
+			int seen = 0;
+
+			if (!fs_files[i].used)
+				continue;
+			for (int j = 0; j < i; j++)
+				if (fs_files[j].used && fs_files[j].index == fs_files[i].index)
+					seen = 1;
+			if (seen)
+				continue;
+			snprintf(name, sizeof(name), "%d", fs_files[i].index);
+			fill(buf, name, NULL, 0, 0);
+		}
+		return 0;
+	}
+
+	if (sscanf(path, "/%d%n", &index, &pos) != 1 || path[pos])
+		return -ENOENT;
+
+	for (int i = 0; i < FS_MAX_FILES; i++) {
+		if (!fs_files[i].used || fs_files[i].index != index)
+			continue;
+		snprintf(name, sizeof(name), "%d-%s", fs_files[i].subindex, fs_files[i].name);
+		fill(buf, name, NULL, 0, 0);
+	}
+	return 0;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{
+	struct fs_file *f = fs_lookup(path);
+
+	if (!f)
+		return -ENOENT;
+
+	fi->direct_io = 1;
+	if (fi->flags & O_TRUNC) {
+		f->size = 0;
+		f->loaded = 1;
+		f->dirty = 1;
+	}
+	return 0;
+}
+
+static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	struct fs_file *f = fs_lookup(path);
+	int index, subindex, pos = 0;
+
+	(void)mode;
+
+	if (!f) {
+		if (sscanf(path, "/%d/%d-%n", &index, &subindex, &pos) != 2 || !pos ||
+		    !path[pos] || strlen(path + pos) > 31 || strchr(path + pos, '/'))
+			return -EINVAL;
+		f = fs_add(index, subindex, path + pos);
+		if (!f)
+			return -ENOSPC;
+	}
+
+	f->size = 0;
+	f->loaded = 1;
+	f->dirty = 1;
+	fi->direct_io = 1;
+	return 0;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fs_file *f = fs_lookup(path);
+	int ret;
+
+	(void)fi;
+	if (!f)
+		return -ENOENT;
+
+	ret = fs_retry(fs_load, f);
+	if (ret < 0)
+		return ret;
+
+	if ((size_t)offset >= f->size)
+		return 0;
+	size = MIN(size, f->size - offset);
+	memcpy(buf, f->data + offset, size);
+	return size;
+}
+
+static int fs_write(const char *path, const char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	struct fs_file *f = fs_lookup(path);
+	int ret;
+
+	(void)fi;
+	if (!f)
+		return -ENOENT;
+
+	ret = fs_retry(fs_load, f);
+	if (ret < 0)
+		return ret;
+
+	ret = fs_reserve(f, offset + size);
+	if (ret < 0)
+		return ret;
+
+	if ((size_t)offset > f->size)
+		memset(f->data + f->size, 0, offset - f->size);
+	memcpy(f->data + offset, buf, size);
+	f->size = MAX(f->size, offset + size);
+	f->dirty = 1;
+	return size;
+}
+
+static int fs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	struct fs_file *f = fs_lookup(path);
+	int ret;
+
+	(void)fi;
+	if (!f)
+		return -ENOENT;
+
+	if (size) {
+		ret = fs_retry(fs_load, f);
+		if (ret < 0)
+			return ret;
+		ret = fs_reserve(f, size);
+		if (ret < 0)
+			return ret;
+		if ((size_t)size > f->size)
+			memset(f->data + f->size, 0, size - f->size);
+	}
+
+	f->size = size;
+	f->loaded = 1;
+	f->dirty = 1;
+
+	/* truncate() on a file nobody has open gets no close() */
+	return fi ? 0 : fs_retry(fs_store, f);
+}
+
+static int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct fs_file *f = fs_lookup(path);
+
+	(void)fi;
+	return f ? fs_retry(fs_store, f) : 0;
+}
+
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void)datasync;
+	return fs_flush(path, fi);
+}
+
+static int fs_unlink(const char *path)
+{
+	struct fs_file *f = fs_lookup(path);
+	int ret;
+
+	if (!f)
+		return -ENOENT;
+
+	ret = fs_retry(fs_remove, f);
+	if (ret < 0)
+		return ret;
+
+	free(f->data);
+	f->used = 0;
+	return 0;
+}
+
+/*
+ * The keyboard can't rename, the file is uploaded under the new index,
+ * subindex and name and the old one deleted. Editors which save to a
+ * temporary file and rename it over the original need this.
+ */
+static int fs_rename(const char *from, const char *to, unsigned int flags)
+{
+	struct fs_file *f = fs_lookup(from), old;
+	int index, subindex, pos = 0, ret;
+
+	if (!f)
+		return -ENOENT;
+
+	/* no RENAME_NOREPLACE or RENAME_EXCHANGE, callers fall back to rename() */
+	if (flags)
+		return -EINVAL;
+
+	if (sscanf(to, "/%d/%d-%n", &index, &subindex, &pos) != 2 || !pos ||
+	    !to[pos] || strlen(to + pos) > 31 || strchr(to + pos, '/'))
+		return -EINVAL;
+
+	if (!strcmp(from, to))
+		return 0;
+
+	ret = fs_retry(fs_load, f);
+	if (ret < 0)
+		return ret;
+
+	old = *f;
+	f->index = index;
+	f->subindex = subindex;
+	snprintf(f->name, sizeof(f->name), "%s", to + pos);
+	f->dirty = 1;
+	ret = fs_retry(fs_store, f);
+	if (ret < 0) {
+		f->index = old.index;
+		f->subindex = old.subindex;
+		memcpy(f->name, old.name, sizeof(f->name));
+		f->dirty = old.dirty;
+		return ret;
+	}
+
+	if (old.index == index && old.subindex == subindex)
+		return 0;
+	return fs_retry(fs_remove, &old);
+}
+
+static const struct fuse_operations fs_ops = {
+	.getattr = fs_getattr,
+	.readdir = fs_readdir,
+	.open = fs_open,
+	.create = fs_create,
+	.read = fs_read,
+	.write = fs_write,
+	.truncate = fs_truncate,
+	.flush = fs_flush,
+	.fsync = fs_fsync,
+	.unlink = fs_unlink,
+	.rename = fs_rename,
+};
+
+static int mount_fs(char *argv0, char *mountpoint)
+{
+	/* single threaded and in foreground, there is only one keyboard link */
+	char *args[] = { argv0, "-f", "-s", mountpoint, NULL };
+
+	return fuse_main(4, args, &fs_ops, NULL) ? -1 : 0;
+}
+#endif
+
+/*
+ * a4 00 returns the first 16 bytes of the configuration, a4 01 all of
+ * it. Replies echo the command, the length of the full one is only
+ * known once the keyboard stops sending.
+ */
+static int read_config(int full, uint8_t *buf, size_t size)
+{
+	uint8_t cmd[] = { HP_CMD_READCONFIG, full };
+	uint8_t reply[sizeof(cmd)], rest[64];
+	int len, more = 0, ret = 0;
+
+	if (write_keyboard(cmd, sizeof(cmd)) == -1) {
+		fprintf(stderr, "%s: send request: %m\n", __func__);
+		return -1;
+	}
+
+	/* the data goes straight into buf, without a copy of the reply */
+	len = read_keyboard_timeout(reply, sizeof(reply), 1000, 100);
+	if (len < (int)sizeof(reply) || memcmp(reply, cmd, sizeof(cmd))) {
+		fprintf(stderr, "%s: invalid reply\n", __func__);
+		return -1;
+	}
+
+	len = read_keyboard_timeout(buf, full ? size : MIN(size, CONFIG_SHORT_SIZE), 100, 100);
+	if (len == -1)
+		return -1;
+
+	/* drop whatever doesn't fit, so the next command starts in sync */
+	while (full && (ret = read_keyboard_timeout(rest, sizeof(rest), 100, 100)) > 0)
+		more += ret;
+	if (ret == -1)
+		return -1;
+	if (more)
+		fprintf(stderr, "%s: config is %d bytes, only the first %d are kept\n", __func__,
+			len + more, len);
+	return len;
+}
+
+/* entries older than CONFIG_CACHE_TTL seconds are dropped */
+static int config_load(struct kbd_config *cfg)
+{
+	struct stat statbuf;
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	if (config_path(path, sizeof(path)) == -1)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &statbuf) == -1 || time(NULL) - statbuf.st_mtime > CONFIG_CACHE_TTL) {
+		close(fd);
+		unlink(path);
 		return -1;
 	}
 
-	if (read_keyboard(&reply, sizeof(reply)) == -1) {
-		fprintf(stderr, "%s: receive header: %m\n", __func__);
+	len = read(fd, cfg, sizeof(*cfg));
+	close(fd);
+	if (len < (ssize_t)offsetof(struct kbd_config, full) || cfg->magic != CONFIG_MAGIC ||
+	    cfg->fulllen > CONFIG_MAX_SIZE ||
+	    len < (ssize_t)offsetof(struct kbd_config, full) + MAX(cfg->fulllen, 0)) {
+		memset(cfg, 0, sizeof(*cfg));
 		return -1;
 	}
-	ret = 0;
+	return 0;
+}
 
-	if (reply.cmd != HP_CMD_DELETE || ntohs(reply.status) != 0xd000) {
-		fprintf(stderr, "%s: delete failed: %04x\n", __func__,
-			ntohs(reply.status));
-		goto out;
+static void config_save(struct kbd_config *cfg)
+{
+	ssize_t len = offsetof(struct kbd_config, full) + MAX(cfg->fulllen, 0);
+	char path[PATH_MAX];
+	int fd;
+
+	if (config_path(path, sizeof(path)) == -1)
+		return;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1)
+		return;
+	if (write(fd, cfg, len) != len)
+		unlink(path);
+	close(fd);
+}
+
+/* short[.OFFSET[:WIDTH]] or full[.OFFSET[:WIDTH]] */
+static int parse_config_field(const char *arg, struct config_field *field)
+{
+	const char *spec = arg;
+	char area[8];
+	int pos = 0;
+
+	field->offset = 0;
+	field->width = 0;
+
+	if (sscanf(spec, "%7[a-z]%n", area, &pos) != 1)
+		goto invalid;
+
+	if (!strcmp(area, "short"))
+		field->full = 0;
+	else if (!strcmp(area, "full"))
+		field->full = 1;
+	else
+		goto invalid;
+
+	spec += pos;
+	if (*spec == '.') {
+		if (sscanf(spec, ".%i%n", &field->offset, &pos) != 1)
+			goto invalid;
+		spec += pos;
+		if (*spec == ':') {
+			if (sscanf(spec, ":%d%n", &field->width, &pos) != 1)
+				goto invalid;
+			spec += pos;
+		}
 	}
 
-out:
-	return ret;
+	if (*spec || field->offset < 0 || (field->width != 1 && field->width != 2 &&
+					   field->width != 4 && field->width != 0) ||
+	    (!field->full && field->offset + field->width > CONFIG_SHORT_SIZE))
+		goto invalid;
+	return 0;
+invalid:
+	fprintf(stderr, "%s: invalid config field: %s\n", __func__, arg);
+	return -1;
 }
 
-static int writefile(char *spec)
+/* everything in the short config can be answered without the full read */
+static int config_needs_full(struct config_field *fields, int count)
 {
-	int index, subindex, ret = -1, infd;
-	struct request_filewrite request;
-	struct reply_fileop reply;
-	char input[32], buf[512];
-	struct stat statbuf;
-	ssize_t total;
+	for (int i = 0; i < count; i++)
+		if (fields[i].full)
+			return 1;
+	return 0;
+}
 
-	if (sscanf(spec, "LAYER%02d.LAY", &subindex) == 1) {
-		index = 9;
-		strcpy(input, spec);
-	} else if (sscanf(spec, "%d,%d,%s", &index, &subindex, input) != 3) {
-		fprintf(stderr, "%s: invalid spec: %s\n", __func__, spec);
+static int config_print(struct kbd_config *cfg, const char *name, struct config_field *field)
+{
+	uint8_t *data = field->full ? cfg->full : cfg->shortcfg;
+	int len = field->full ? cfg->fulllen : CONFIG_SHORT_SIZE;
+	uint32_t value = 0;
+
+	if (field->offset + MAX(field->width, 1) > len) {
+		fprintf(stderr, "%s: %s beyond end of config (%d bytes)\n", __func__, name, len);
 		return -1;
 	}
 
-	if (strlen(input) > 31) {
-		fprintf(stderr, "%s: filename %s too long\n", __func__, input);
-		return -1;
+	if (!field->width) {
+		printf("%s:", name);
+		for (int i = field->offset; i < len; i++)
+			printf(" %02x", data[i]);
+		printf("\n");
+		return 0;
 	}
 
-	infd = open(input, O_RDONLY);
-	if (infd == -1) {
-		fprintf(stderr, "%s: failed to open %s: %m\n", __func__, input);
+	for (int i = 0; i < field->width; i++)
+		value = value << 8 | data[field->offset + i];
+	printf("%s: %u\n", name, value);
+	return 0;
+}
+
+static int get_config(struct kbd_config *cfg, int full)
+{
+	int len;
+
+	if (cfg->magic != CONFIG_MAGIC) {
+		len = read_config(0, cfg->shortcfg, sizeof(cfg->shortcfg));
+		if (len != CONFIG_SHORT_SIZE)
+			return -1;
+		cfg->magic = CONFIG_MAGIC;
+		cfg->fulllen = -1;
+	}
+
+	if (full && cfg->fulllen == -1) {
+		len = read_config(1, cfg->full, sizeof(cfg->full));
+		if (len == -1)
+			return -1;
+		cfg->fulllen = len;
+	}
+
+	config_save(cfg);
+	return 0;
+}
+
+static long realtime_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* +-10% so polls of several keyboards spread out over the interval */
+static long mon_jitter(long interval)
+{
+	return interval + (random() % (interval / 5 + 1)) - interval / 10;
+}
+
+static int mon_poll(struct mon_keyboard *kbd, int q, long interval)
+{
+	const struct mon_query *query = &mon_queries[q];
+	struct mon_value *v = &kbd->values[q];
+	uint8_t buf[sizeof(v->data) + 2];
+	int len;
+
+	if (write_keyboard((void *)query->cmd, sizeof(query->cmd)) == -1)
+		return -1;
+
+	len = read_keyboard_timeout(buf, sizeof(buf), MON_TIMEOUT, MON_GAP);
+	if (len < (int)sizeof(query->cmd) || memcmp(buf, query->cmd, sizeof(query->cmd))) {
+		/* garbage or nothing, drop whatever is still underway */
+		read_keyboard_timeout(buf, sizeof(buf), MON_GAP, MON_GAP);
 		return -1;
 	}
 
-	if (fstat(infd, &statbuf) == -1) {
-		fprintf(stderr, "fstat: %m\n");
-		goto out;
+	len -= sizeof(query->cmd);
+	if (v->valid && v->len == len && !memcmp(v->data, buf + 2, len)) {
+		v->interval = MIN(v->interval * 2, interval * MON_MAX_BACKOFF);
+	} else {
+		memcpy(v->data, buf + 2, len);
+		v->len = len;
+		v->valid = 1;
+		v->changed = realtime_ms();
+		v->interval = interval;
 	}
+	v->due = now_ms() + mon_jitter(v->interval);
+	return 0;
+}
 
-	total = statbuf.st_size;
-	memset(&request, 0, sizeof(request));
-	strncpy(request.filename, input, sizeof(request.filename)-1);
-	request.index = htons(index);
-	request.subindex = htons(subindex);
-	request.size = htonl(statbuf.st_size);
-	request.cmd = HP_CMD_WRITEFILE;
+static void mon_text(struct mon_value *v, char *out, size_t size)
+{
+	size_t n = 0;
 
-	if (write_keyboard(&request, sizeof(request)) == -1) {
-		fprintf(stderr, "%s: failed to write request: %m\n", __func__);
-		goto out;
+	for (int i = 0; i < v->len && n + 2 < size; i++) {
+		uint8_t c = v->data[i];
+
+		if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\')
+			out[n++] = c;
+		else if (n && out[n - 1] != ',' && i != v->len - 1)
+			out[n++] = ',';
 	}
+	out[n] = '\0';
+}
 
-	do {
-		ret = read(infd, buf, MIN(total, sizeof(buf)));
-		if (ret == -1) {
-			fprintf(stderr, "%s: read: %m\n", __func__);
-			goto out;
+static void mon_write_json(FILE *f, struct mon_keyboard *kbds, int count)
+{
+	char text[512];
+
+	fprintf(f, "[\n");
+	for (int k = 0; k < count; k++) {
+		fprintf(f, "  { \"device\": \"%s\", \"up\": %d", kbds[k].name, kbds[k].up);
+		/* the last values of a keyboard that is down are no longer current */
+		for (size_t q = 0; q < MON_QUERIES && kbds[k].up; q++) {
+			struct mon_value *v = &kbds[k].values[q];
+
+			if (!v->valid)
+				continue;
+			mon_text(v, text, sizeof(text));
+			if (mon_queries[q].text)
+				fprintf(f, ", \"%s\": \"%s\"", mon_queries[q].name, text);
+			else
+				fprintf(f, ", \"%s\": %d", mon_queries[q].name, v->len ? v->data[0] : -1);
 		}
+		fprintf(f, " }%s\n", k == count - 1 ? "" : ",");
+	}
+	fprintf(f, "]\n");
+}
 
-		if (ret == 0)
-			break;
-
-		ret = write_keyboard(buf, ret);
-		if (ret == -1) {
-			fprintf(stderr, "%s: send request: %m\n", __func__);
-			goto out;
+/* Prometheus text format, all samples of a metric have to be grouped */
+static void mon_write_prom(FILE *f, struct mon_keyboard *kbds, int count)
+{
+	char text[512];
+
+	fprintf(f, "# TYPE weytool_up gauge\n");
+	for (int k = 0; k < count; k++)
+		fprintf(f, "weytool_up{device=\"%s\"} %d\n", kbds[k].name, kbds[k].up);
+
+	/* values are only exported while a keyboard is up */
+	fprintf(f, "# TYPE weytool_info gauge\n");
+	for (int k = 0; k < count; k++) {
+		if (!kbds[k].up)
+			continue;
+		fprintf(f, "weytool_info{device=\"%s\"", kbds[k].name);
+		for (size_t q = 0; q < MON_QUERIES; q++) {
+			if (!mon_queries[q].text || !kbds[k].values[q].valid)
+				continue;
+			mon_text(&kbds[k].values[q], text, sizeof(text));
+			fprintf(f, ",%s=\"%s\"", mon_queries[q].name, text);
 		}
+		fprintf(f, "} 1\n");
+	}
 
-		total -= ret;
-		fprintf(stderr, "sent %d bytes, %ld remaining\n", ret, total);
-	} while(total > 0);
+	for (size_t q = 0; q < MON_QUERIES; q++) {
+		if (mon_queries[q].text)
+			continue;
+		fprintf(f, "# TYPE weytool_%s gauge\n", mon_queries[q].name);
+		for (int k = 0; k < count; k++) {
+			struct mon_value *v = &kbds[k].values[q];
 
-	if (read_keyboard(&reply,sizeof(reply)) == -1)
-		goto out;
+			if (kbds[k].up && v->valid && v->len)
+				fprintf(f, "weytool_%s{device=\"%s\"} %d\n", mon_queries[q].name,
+					kbds[k].name, v->data[0]);
+		}
+	}
 
-	if (reply.cmd != HP_CMD_WRITEFILE || ntohs(reply.status) != 0xd000) {
-		fprintf(stderr, "%s: %s: failed: %04x\n", __func__,
-			input, ntohs(reply.status));
-		goto out;
+	fprintf(f, "# TYPE weytool_last_change_seconds gauge\n");
+	for (int k = 0; k < count; k++) {
+		for (size_t q = 0; q < MON_QUERIES; q++) {
+			struct mon_value *v = &kbds[k].values[q];
+
+			if (kbds[k].up && v->valid)
+				fprintf(f, "weytool_last_change_seconds{device=\"%s\",value=\"%s\"} %ld\n",
+					kbds[k].name, mon_queries[q].name, v->changed / 1000);
+		}
 	}
-	ret = 0;
-out:
-	close(infd);
-	return ret;
 }
 
-static int reboot_kbd(void)
+static int mon_write(struct mon_keyboard *kbds, int count, const char *path)
 {
-	uint8_t cmd[] = { 0x7f, 0xe4, 0x31, 0xc0, 0x02 };
+	size_t len = strlen(path);
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "%s: open %s: %m\n", __func__, tmp);
+		return -1;
+	}
 
-	if (write_keyboard(cmd, sizeof(cmd)) == 1) {
-		fprintf(stderr, "%s: %m\n", __func__);
+	if (len > 5 && !strcmp(path + len - 5, ".json"))
+		mon_write_json(f, kbds, count);
+	else
+		mon_write_prom(f, kbds, count);
+
+	/* rename, so readers never see a partial file */
+	if (fclose(f) == EOF || rename(tmp, path) == -1) {
+		fprintf(stderr, "%s: %s: %m\n", __func__, path);
+		unlink(tmp);
 		return -1;
 	}
 	return 0;
 }
 
-static int rawtx(uint8_t *buf, int size)
+/*
+ * Poll ID, module versions, test status and brightness of all keyboards.
+ * Every value has its own schedule: it is polled every interval seconds
+ * while it changes and backs off up to MON_MAX_BACKOFF times as long as
+ * it stays the same. The metrics file is rewritten after each round
+ * from the last known values.
+ */
+static int monitor(char **devices, int ndevices, int baud, int interval, const char *path)
 {
-	return write_keyboard(buf, size);
+	struct mon_keyboard kbds[MAX_KEYBOARDS];
+	int count = MAX(ndevices, 1), usbfd = kbfd;
+	long ival = interval * 1000L;
+
+	signal(SIGINT, stop_handler);
+	signal(SIGTERM, stop_handler);
+	srandom(getpid());
+
+	memset(kbds, 0, sizeof(kbds));
+	for (int k = 0; k < count; k++) {
+		kbds[k].name = ndevices ? devices[k] : "usb";
+		kbds[k].fd = k ? open_serial(devices[k], baud) : usbfd;
+		if (k && kbds[k].fd == -1)
+			return -1;
+	}
+
+	while (!stop) {
+		long now = now_ms(), next = now + ival;
+		int polled = 0;
+
+		for (int k = 0; k < count && !stop; k++) {
+			struct mon_keyboard *kbd = &kbds[k];
+			int answered = 0, failed = 0;
+
+			kbfd = kbd->fd;
+			for (size_t q = 0; q < MON_QUERIES && !stop; q++) {
+				struct mon_value *v = &kbd->values[q];
+
+				if (v->due > now) {
+					next = MIN(next, v->due);
+					continue;
+				}
+
+				if (mon_poll(kbd, q, ival) == 0) {
+					answered++;
+				} else {
+					/* retry soon, but don't hammer a dead keyboard */
+					v->interval = ival;
+					v->due = now + mon_jitter(ival);
+					failed++;
+				}
+				next = MIN(next, v->due);
+				polled = 1;
+			}
+
+			/* down only when none of the queries of this round got an answer */
+			if (answered) {
+				kbd->up = 1;
+			} else if (failed) {
+				kbd->up = 0;
+				/* poll everything again once it is back */
+				for (size_t q = 0; q < MON_QUERIES; q++) {
+					kbd->values[q].interval = ival;
+					kbd->values[q].due = MIN(kbd->values[q].due, now + mon_jitter(ival));
+					next = MIN(next, kbd->values[q].due);
+				}
+			}
+		}
+		kbfd = usbfd;
+
+		if (polled && mon_write(kbds, count, path) == -1)
+			return -1;
+
+		now = now_ms();
+		if (next > now && !stop)
+			usleep((next - now) * 1000);
+	}
+
+	for (int k = 1; k < count; k++)
+		close(kbds[k].fd);
+	return 0;
 }
 
-static int rawrx(int size)
+#ifndef WEY_EMBEDDED
+static int rollout_group(struct rollout_group *groups, int *ngroups, const char *name, int limit)
 {
-	char *buf;
-	int ret;
+	for (int i = 0; i < *ngroups; i++)
+		if (!strcmp(groups[i].name, name))
+			return i;
 
-	if (size > 1048576) {
-		fprintf(stderr, "%s: size exceeds limit of 1MB\n", __func__);
+	if (*ngroups == ROLLOUT_MAX_GROUPS || strlen(name) >= sizeof(groups[0].name)) {
+		fprintf(stderr, "%s: too many groups or name too long: %s\n", __func__, name);
 		return -1;
 	}
-	buf = malloc(size);
-	if (!buf) {
-		fprintf(stderr, "%s: failed to allocate rx buffer\n", __func__);
+	strcpy(groups[*ngroups].name, name);
+	groups[*ngroups].limit = limit;
+	groups[*ngroups].running = 0;
+	return (*ngroups)++;
+}
+
+static void rollout_free(struct rollout_job *job)
+{
+	free(job->device);
+	for (int i = 0; i < ROLLOUT_MAX_OPS; i++)
+		free(job->ops[i].spec);
+}
+
+/*
+ * One keyboard per line: device, group and the operations for it, e.g.
+ *   /dev/ttyUSB0 hub1 -d 9,12 -w LAYER10.LAY -w 5,22,icon22.bmp
+ * "limit <group> <n>" allows n keyboards of a group to run at once.
+ * Deletes of files that aren't there succeed, so a retried job doesn't
+ * fail on what its first run already deleted.
+ */
+static int rollout_parse(const char *path, struct rollout_job *jobs, struct rollout_group *groups,
+			 int *ngroups, int limit)
+{
+	char *line = NULL, *save, *tok, *dev, *grp;
+	int njobs = 0, lineno = 0, started = 0, g, n;
+	size_t len = 0;
+	struct stat statbuf;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "open %s: %m\n", path);
 		return -1;
 	}
-	ret = read_keyboard(buf, size);
-	if (ret) {
-		free(buf);
-		return ret;
+
+	while (getline(&line, &len, f) != -1) {
+		struct rollout_job *job = &jobs[njobs];
+
+		lineno++;
+		dev = strtok_r(line, " \t\n", &save);
+		if (!dev || *dev == '#')
+			continue;
+
+		grp = strtok_r(NULL, " \t\n", &save);
+		if (!grp)
+			goto invalid;
+
+		if (!strcmp(dev, "limit")) {
+			tok = strtok_r(NULL, " \t\n", &save);
+			n = tok ? atoi(tok) : 0;
+			if (n <= 0)
+				goto invalid;
+			g = rollout_group(groups, ngroups, grp, n);
+			if (g == -1)
+				goto err;
+			groups[g].limit = n;
+			continue;
+		}
+
+		if (njobs == ROLLOUT_MAX_JOBS) {
+			fprintf(stderr, "%s: more than %d keyboards\n", path, ROLLOUT_MAX_JOBS);
+			goto err;
+		}
+
+		memset(job, 0, sizeof(*job));
+		started = 1;
+		job->device = strdup(dev);
+		job->group = rollout_group(groups, ngroups, grp, limit);
+		if (!job->device || job->group == -1)
+			goto err;
+
+		while ((tok = strtok_r(NULL, " \t\n", &save))) {
+			int cmd = !strcmp(tok, "-w") ? HP_CMD_WRITEFILE :
+				  !strcmp(tok, "-d") ? HP_CMD_DELETE : 0;
+			char *spec = strtok_r(NULL, " \t\n", &save);
+			struct fileop *op = &job->ops[job->nops];
+
+			if (!cmd || !spec || job->nops == ROLLOUT_MAX_OPS)
+				goto invalid;
+
+			spec = strdup(spec);
+			if (!spec) {
+				fprintf(stderr, "out of memory\n");
+				goto err;
+			}
+			/* op->spec owns it from here on, also on errors */
+			if (parse_fileop(cmd, spec, op) == -1)
+				goto invalid;
+			op->missing_ok = op->cmd == HP_CMD_DELETE;
+
+			if (op->cmd != HP_CMD_DELETE) {
+				if (stat(op->input, &statbuf) == -1) {
+					fprintf(stderr, "%s:%d: %s: %m\n", path, lineno, op->input);
+					goto err;
+				}
+				job->cost += statbuf.st_size;
+			}
+			job->cost += ROLLOUT_OP_BYTES;
+			job->nops++;
+		}
+
+		if (!job->nops)
+			goto invalid;
+		njobs++;
+		started = 0;
 	}
-	hexdump("RX", buf, size);
-	free(buf);
-	return 0;
+	free(line);
+	fclose(f);
+	return njobs;
+invalid:
+	fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+err:
+	for (int i = 0; i < njobs + started; i++)
+		rollout_free(&jobs[i]);
+	free(line);
+	fclose(f);
+	return -1;
+}
+
+/* largest jobs first, so the long ones don't end up as the tail */
+static int rollout_cmp(const void *a, const void *b)
+{
+	const struct rollout_job *ja = a, *jb = b;
+
+	return ja->cost < jb->cost ? 1 : ja->cost > jb->cost ? -1 : 0;
 }
 
+/* runs in a forked child, output goes to rollout-<device>.log */
+static int rollout_worker(struct rollout_job *job, int baud)
+{
+	char path[PATH_MAX], name[64];
+	size_t i;
+	int fd, ret;
+
+	for (i = 0; job->device[i] && i < sizeof(name) - 1; i++)
+		name[i] = isalnum((unsigned char)job->device[i]) || job->device[i] == '-' ? job->device[i] : '_';
+	name[i] = '\0';
+
+	snprintf(path, sizeof(path), "rollout-%s.log", name);
+	fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	if (fd != -1) {
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+
+	snprintf(kbd_key, sizeof(kbd_key), "%s", job->device);
+	kbfd = open_serial(job->device, baud);
+	if (kbfd == -1)
+		return -1;
+	io_byte_us = 10000000 / baud;
+
+	ret = run_fileops(job->ops, job->nops);
+	close(kbfd);
+	return ret;
+}
+
+/*
+ * Expected time until all is done: each group works through what is
+ * left of it with as many keyboards in parallel as its limit allows.
+ */
+static long rollout_eta(struct rollout_job *jobs, int njobs, struct rollout_group *groups,
+			int ngroups, double ms_per_byte)
+{
+	long eta = 0, now = now_ms();
+
+	for (int g = 0; g < ngroups; g++) {
+		long left = 0;
+		int count = 0;
+
+		for (int i = 0; i < njobs; i++) {
+			if (jobs[i].group != g)
+				continue;
+			if (jobs[i].state == JOB_PENDING) {
+				left += jobs[i].cost * ms_per_byte;
+				count++;
+			} else if (jobs[i].state == JOB_RUNNING) {
+				left += MAX(0, jobs[i].cost * ms_per_byte - (now - jobs[i].start));
+				count++;
+			}
+		}
+		if (count)
+			eta = MAX(eta, left / MIN(count, groups[g].limit));
+	}
+	return eta;
+}
+
+static int rollout(const char *plan, int baud, int limit)
+{
+	static struct rollout_job jobs[ROLLOUT_MAX_JOBS];
+	struct rollout_group groups[ROLLOUT_MAX_GROUPS];
+	int njobs, ngroups = 0, finished = 0, failed = 0, running = 0, status;
+	/* until the first keyboard is done, assume the nominal line rate */
+	double ms_per_byte = 10000.0 / baud;
+	long done_cost = 0, done_ms = 0;
+	pid_t pid;
+
+	njobs = rollout_parse(plan, jobs, groups, &ngroups, limit);
+	if (njobs <= 0)
+		return njobs;
+
+	qsort(jobs, njobs, sizeof(*jobs), rollout_cmp);
+	signal(SIGINT, stop_handler);
+	signal(SIGTERM, stop_handler);
+
+	while (finished < njobs && (running || !stop)) {
+		long now = now_ms();
+
+		for (int i = 0; i < njobs && !stop; i++) {
+			struct rollout_job *job = &jobs[i];
+			struct rollout_group *group = &groups[job->group];
+
+			if (job->state != JOB_PENDING || job->next_try > now ||
+			    group->running >= group->limit)
+				continue;
+
+			fflush(stdout);
+			pid = fork();
+			if (pid == -1) {
+				fprintf(stderr, "fork: %m\n");
+				break;
+			}
+			if (!pid)
+				_exit(rollout_worker(job, baud) == 0 ? 0 : 1);
+
+			job->pid = pid;
+			job->start = now;
+			job->state = JOB_RUNNING;
+			group->running++;
+			running++;
+		}
+
+		pid = waitpid(-1, &status, WNOHANG);
+		if (pid <= 0) {
+			usleep(100000);
+			continue;
+		}
+
+		for (int i = 0; i < njobs; i++) {
+			struct rollout_job *job = &jobs[i];
+			long eta;
+
+			if (job->state != JOB_RUNNING || job->pid != pid)
+				continue;
+
+			groups[job->group].running--;
+			running--;
+			now = now_ms();
+
+			if (WIFEXITED(status) && !WEXITSTATUS(status)) {
+				job->state = JOB_DONE;
+				finished++;
+				done_cost += job->cost;
+				done_ms += now - job->start;
+				ms_per_byte = (double)done_ms / done_cost;
+				printf("%s: done in %.1fs", job->device, (now - job->start) / 1000.0);
+			} else if (++job->tries > ROLLOUT_RETRIES) {
+				job->state = JOB_FAILED;
+				finished++;
+				failed++;
+				printf("%s: failed, giving up", job->device);
+			} else {
+				job->state = JOB_PENDING;
+				job->next_try = now + ((long)ROLLOUT_BACKOFF << (job->tries - 1));
+				printf("%s: failed, retry %d of %d in %lds", job->device, job->tries,
+				       ROLLOUT_RETRIES, (job->next_try - now) / 1000);
+			}
+
+			eta = rollout_eta(jobs, njobs, groups, ngroups, ms_per_byte);
+			printf(" [%d/%d, %d failed, %.0f bytes/s, eta %ld:%02ld]\n", finished, njobs,
+			       failed, 1000.0 / ms_per_byte, eta / 60000, eta / 1000 % 60);
+			break;
+		}
+	}
+
+	if (finished < njobs)
+		printf("stopped, %d of %d keyboards not done\n", njobs - finished, njobs);
+	for (int i = 0; i < njobs; i++)
+		rollout_free(&jobs[i]);
+	return failed || finished < njobs ? -1 : 0;
+}
+#endif
+
 static libusb_device_handle *open_keyboard_usb(struct libusb_context *ctx, int id)
 {
 	libusb_device_handle *dev = libusb_open_device_with_vid_pid(ctx, 0x0744, id);
@@ -654,16 +3536,38 @@ static uint8_t *parse_rawcmd(char *arg, int *rawcount)
 
 int main(int argc, char **argv)
 {
-	char *device = NULL, *endp, *write = NULL, *read = NULL, *delete = NULL;
+	char *device = NULL, *endp;
+	char *writes[MAX_FILEOPS], *reads[MAX_FILEOPS], *deletes[MAX_FILEOPS];
+	int nwrites = 0, nreads = 0, ndeletes = 0, nops = 0;
+	static struct fileop ops[3 * MAX_FILEOPS];
 	int list = 0, optidx, opt, baud = 115200;
 	struct libusb_context *ctx = NULL;
-	int ret = 1, reboot = 0, rawtxsize = 0, rawrxsize = 0;
+	int ret = 1, reboot = 0, rawtxsize = 0, rawrxsize = 0, lcd = 0;
+	char *devices[MAX_KEYBOARDS], *scandb = "scan.tsv", *metrics = "weytool.prom";
+	struct scanspec scanspecs[MAX_SCANSPECS];
+	int ndevices = 0, nscanspecs = 0, dbfd = -1, moninterval = 0;
+	struct config_field fields[MAX_GETS];
+	static struct kbd_config config;
+	char *gets[MAX_GETS], *id = NULL, *control_path = NULL;
+#ifndef WEY_EMBEDDED
+	char *plan = NULL;
+	int rollout_limit = 1;
+#endif
+	int ngets = 0, cached = 0, kbd_ops;
+#ifdef WITH_FUSE
+	char *mountpoint = NULL;
+#endif
 	uint8_t *rawlist;
 
 	while ((opt = getopt_long(argc, argv, "hvRlD:d:b:w:r:", options, &optidx)) != -1) {
 		 switch (opt) {
 		 case 'D':
-			 device = optarg;
+			 if (ndevices == MAX_KEYBOARDS) {
+				 fprintf(stderr, "too many devices, max %d\n", MAX_KEYBOARDS);
+				 return 1;
+			 }
+			 devices[ndevices++] = optarg;
+			 device = devices[0];
 			 break;
 		 case 'b':
 			 baud = strtoul(optarg, &endp, 10);
@@ -676,13 +3580,25 @@ int main(int argc, char **argv)
 			 list = 1;
 			 break;
 		 case 'w':
-			 write = optarg;
+			 if (nwrites == MAX_FILEOPS) {
+				 fprintf(stderr, "too many files, max %d\n", MAX_FILEOPS);
+				 return 1;
+			 }
+			 writes[nwrites++] = optarg;
 			 break;
 		 case 'r':
-			 read = optarg;
+			 if (nreads == MAX_FILEOPS) {
+				 fprintf(stderr, "too many files, max %d\n", MAX_FILEOPS);
+				 return 1;
+			 }
+			 reads[nreads++] = optarg;
 			 break;
 		 case 'd':
-			 delete = optarg;
+			 if (ndeletes == MAX_FILEOPS) {
+				 fprintf(stderr, "too many files, max %d\n", MAX_FILEOPS);
+				 return 1;
+			 }
+			 deletes[ndeletes++] = optarg;
 			 break;
 		 case 'v':
 			 verbose = 1;
@@ -702,18 +3618,100 @@ int main(int argc, char **argv)
 				 return 1;
 			 }
 			 break;
+		 case OPT_DISPLAY:
+			 lcd = 1;
+			 break;
+		 case OPT_CONTROL:
+			 control_path = optarg;
+			 break;
+		 case OPT_SCAN:
+			 if (nscanspecs == MAX_SCANSPECS) {
+				 fprintf(stderr, "too many scan specs, max %d\n", MAX_SCANSPECS);
+				 return 1;
+			 }
+			 if (parse_scanspec(optarg, &scanspecs[nscanspecs++]) == -1)
+				 return 1;
+			 break;
+		 case OPT_SCANDB:
+			 scandb = optarg;
+			 break;
+		 case OPT_MONITOR:
+			 moninterval = strtoul(optarg, &endp, 10);
+			 if (*endp || !moninterval) {
+				 fprintf(stderr, "invalid monitor interval: %s\n", optarg);
+				 return 1;
+			 }
+			 break;
+		 case OPT_METRICS:
+			 metrics = optarg;
+			 break;
+		 case OPT_GET:
+			 if (ngets == MAX_GETS) {
+				 fprintf(stderr, "too many config fields, max %d\n", MAX_GETS);
+				 return 1;
+			 }
+			 if (parse_config_field(optarg, &fields[ngets]) == -1)
+				 return 1;
+			 gets[ngets++] = optarg;
+			 break;
+		 case OPT_ID:
+			 id = optarg;
+			 break;
+#ifndef WEY_EMBEDDED
+		 case OPT_ROLLOUT:
+			 plan = optarg;
+			 break;
+		 case OPT_ROLLOUT_LIMIT:
+			 rollout_limit = strtoul(optarg, &endp, 10);
+			 if (*endp || !rollout_limit) {
+				 fprintf(stderr, "invalid limit: %s\n", optarg);
+				 return 1;
+			 }
+			 break;
+#endif
+		 case OPT_TIMEOUT:
+			 io_timeout = strtoul(optarg, &endp, 10);
+			 if (*endp || !io_timeout) {
+				 fprintf(stderr, "invalid timeout: %s\n", optarg);
+				 return 1;
+			 }
+			 break;
+#ifdef WITH_FUSE
+		 case OPT_MOUNT:
+			 mountpoint = optarg;
+			 break;
+#endif
 		 case 'h':
 			 fprintf(stderr, "%s: usage:%s <options>\n"
-				 "-D, --device            serial device\n"
+				 "-D, --device            serial device, may be given several times\n"
 				 "-b, --baud,-b           baud rate\n"
 				 "-l, --list              list files on keyboard\n"
-				 "-w, --write <file>      upload file to keyboard\n"
-				 "-r, --read <file>       download file from keyboard\n"
-				 "-d, --delete <file>     delete file from keyboard\n"
+				 "-w, --write <file>      upload file to keyboard, may be given several times\n"
+				 "-r, --read <file>       download file from keyboard, may be given several times\n"
+				 "-d, --delete <file>     delete file from keyboard, may be given several times\n"
 				 "-R, --reboot            reboot keyboard\n"
 				 "-v, --verbose           log data transfers\n"
 				 "    --rawcmd <hexbytes> send raw cmd to keyboard\n"
-				 "    --rawrx <len>       receive raw response from keyboard\n",
+				 "    --rawrx <len>       receive raw response from keyboard\n"
+				 "    --display           update LCD and LEDs from frames on stdin\n"
+				 "    --control <socket>  serve ws/layer/page switches on a unix socket, - for stdin\n"
+				 "    --scan <spec>       probe command space, e.g. 7f,00-ff\n"
+				 "    --scan-db <file>    append scan results to file (default scan.tsv)\n"
+				 "    --get <field>       print config field: short|full[.offset[:width]]\n"
+				 "    --id <name>         name of the keyboard for cached data, needed\n"
+				 "                        to cache the config\n"
+				 "    --timeout <ms>      wait this long for a reply (default 3000)\n"
+#ifndef WEY_EMBEDDED
+				 "    --rollout <plan>    run the file operations of a plan on many keyboards\n"
+				 "    --rollout-limit <n> keyboards per group at once (default 1)\n"
+#endif
+				 "    --monitor <secs>    poll keyboard health, back off while unchanged\n"
+				 "    --metrics <file>    monitor output, JSON if it ends in .json\n"
+				 "                        (default weytool.prom)\n"
+#ifdef WITH_FUSE
+				 "    --mount <dir>       mount keyboard storage at dir\n"
+#endif
+				 ,
 				 argv[0], argv[0]);
 			 return 0;
 		 default:
@@ -721,6 +3719,42 @@ int main(int argc, char **argv)
 		 }
 	 }
 
+#ifndef WEY_EMBEDDED
+	if (plan)
+		return rollout(plan, baud, rollout_limit) == 0 ? 0 : 1;
+#endif
+
+	snprintf(kbd_key, sizeof(kbd_key), "%s", id ? id : device ? device : "usb");
+	kbd_named = id != NULL;
+
+	for (int i = 0; i < ndeletes; i++)
+		if (parse_fileop(HP_CMD_DELETE, deletes[i], &ops[nops++]) == -1)
+			return 1;
+	for (int i = 0; i < nreads; i++)
+		if (parse_fileop(HP_CMD_READFILE, reads[i], &ops[nops++]) == -1)
+			return 1;
+	for (int i = 0; i < nwrites; i++)
+		if (parse_fileop(HP_CMD_WRITEFILE, writes[i], &ops[nops++]) == -1)
+			return 1;
+
+	kbd_ops = list || nops || rawtxsize || rawrxsize || lcd || control_path || nscanspecs ||
+		moninterval || reboot;
+#ifdef WITH_FUSE
+	kbd_ops |= mountpoint != NULL;
+#endif
+
+	/* answer config queries from cache, without touching the keyboard if that's all */
+	if (ngets && config_load(&config) == 0 &&
+	    (config.fulllen != -1 || !config_needs_full(fields, ngets))) {
+		ret = 0;
+		for (int i = 0; i < ngets; i++)
+			if (config_print(&config, gets[i], &fields[i]) == -1)
+				ret = 1;
+		if (ret || !kbd_ops)
+			return ret;
+		cached = 1;
+	}
+
 	 /*
 	  * If the keyboard we're talking to is the keyboard control this pc,
 	  * we might block the keyboard before it could send the key up event.
@@ -729,6 +3763,33 @@ int main(int argc, char **argv)
 	  */
 	sleep(1);
 
+	if (nscanspecs) {
+		dbfd = open(scandb, O_WRONLY|O_CREAT|O_APPEND, 0644);
+		if (dbfd == -1) {
+			fprintf(stderr, "open %s: %m\n", scandb);
+			return 1;
+		}
+
+		/* every further keyboard gets its own worker and share of the space */
+		for (int i = 1; i < ndevices; i++) {
+			pid_t pid = fork();
+
+			if (pid == -1) {
+				fprintf(stderr, "fork: %m\n");
+				return 1;
+			}
+			if (pid)
+				continue;
+
+			kbfd = open_serial(devices[i], baud);
+			if (kbfd == -1)
+				_exit(1);
+			ret = scan(scanspecs, nscanspecs, i, ndevices, dbfd, devices[i]);
+			close(kbfd);
+			_exit(ret == 0 ? 0 : 1);
+		}
+	}
+
 	if (!device) {
 		/* no serial device give, try usb */
 		int ret = libusb_init(&ctx);
@@ -747,28 +3808,29 @@ int main(int argc, char **argv)
 		kbfd = open_serial(device, baud);
 		if (kbfd == -1)
 			return 1;
+		/* 8N1 puts 10 bits on the line per byte */
+		io_byte_us = 10000000 / baud;
 	}
 
-	if (list) {
-		ret = listfiles();
+	if (ngets && !cached) {
+		ret = get_config(&config, config_needs_full(fields, ngets));
 		if (ret == -1)
 			goto out;
-	}
-
-	if (delete) {
-		ret = deletefile(delete);
+		for (int i = 0; i < ngets; i++)
+			if (config_print(&config, gets[i], &fields[i]) == -1)
+				ret = -1;
 		if (ret == -1)
 			goto out;
 	}
 
-	if (read) {
-		ret = readfile(read);
+	if (list) {
+		ret = retry(listfiles, NULL, "list");
 		if (ret == -1)
 			goto out;
 	}
 
-	if (write) {
-		ret = writefile(write);
+	if (nops) {
+		ret = run_fileops(ops, nops);
 		if (ret == -1)
 			goto out;
 	}
@@ -785,6 +3847,45 @@ int main(int argc, char **argv)
 			goto out;
 	}
 
+	if (lcd) {
+		ret = display();
+		if (ret == -1)
+			goto out;
+	}
+
+	if (control_path) {
+		ret = control(control_path);
+		if (ret == -1)
+			goto out;
+	}
+
+	if (nscanspecs) {
+		int status;
+
+		ret = scan(scanspecs, nscanspecs, 0, MAX(ndevices, 1), dbfd, device ? device : "usb");
+		while (wait(&status) > 0) {
+			if (!WIFEXITED(status) || WEXITSTATUS(status))
+				ret = -1;
+		}
+		close(dbfd);
+		if (ret == -1)
+			goto out;
+	}
+
+	if (moninterval) {
+		ret = monitor(devices, ndevices, baud, moninterval, metrics);
+		if (ret == -1)
+			goto out;
+	}
+
+#ifdef WITH_FUSE
+	if (mountpoint) {
+		ret = mount_fs(argv[0], mountpoint);
+		if (ret == -1)
+			goto out;
+	}
+#endif
+
 	if (reboot)
 		ret = reboot_kbd();
 out_release: